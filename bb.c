@@ -7,10 +7,14 @@
 //
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <glob.h>
 #include <limits.h>
+#include <poll.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -20,13 +24,27 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bigdir.h"
+#include "colors.h"
 #include "draw.h"
+#include "latency.h"
+#include "links.h"
+#include "mem.h"
+#include "owners.h"
+#include "rename.h"
+#include "session.h"
 #include "terminal.h"
 #include "types.h"
 #include "utils.h"
+#include "xattrs.h"
 
 #ifndef BB_NAME
 #define BB_NAME "bb"
@@ -34,6 +52,24 @@
 
 #define BB_VERSION "0.31.0"
 #define MAX_BINDINGS 1024
+// How many recent sort orders to remember for the current directory:
+#define SORT_CACHE_SIZE 4
+// How often to check whether the key bindings file has changed:
+#define BINDINGS_CHECK_INTERVAL 1
+// Script output beyond this size is discarded (oldest first):
+#define OUTPUT_BUFFER_MAX ((off_t)1 << 20)
+// How long warnings are shown in the status line:
+#define WARNING_SECONDS 5
+// How many keys can be pressed while waiting for the key bindings to load:
+#define MAX_QUEUED_KEYS 256
+// How often to save the session snapshot (if $BBSESSION is set and anything happened):
+#define SESSION_SAVE_INTERVAL 60
+// How many files to check at a time when a listing was resumed from a session snapshot:
+#define SESSION_VERIFY_BATCH 1000
+// How many files' extended attributes can be waiting to be looked up in the background:
+#define XATTRS_BACKLOG 256
+// Wait until the terminal hasn't been resized for this long before redrawing:
+#define RESIZE_SETTLE_MS 50
 #define SCROLLOFF MIN(5, (winsize.ws_row - 4) / 2)
 #define ONSCREEN (winsize.ws_row - 3)
 
@@ -44,24 +80,82 @@
         fclose(f);                                                                                                     \
     } while (0)
 
+// A selected file, for combining the selection with a saved selection. Files
+// in big directory listings that aren't loaded have no entry, just an ID.
+typedef struct {
+    char *path;
+    entry_t *entry;
+    int id;
+} selected_file_t;
+
 // Functions
+static void add_bindings(bb_t *bb, binding_t *table, const char *def, int in_place);
+static void adopt_selection(bb_t *bb);
 void bb_browse(bb_t *bb, int argc, char *argv[]);
+static uint64_t bbkeys_signature(void);
+static int binds_key(const char *def, int keyval);
+static void cache_sort_order(bb_t *bb);
+static void check_bindings_file(bb_t *bb);
+static void check_clock(bb_t *bb);
 static void check_cmdfile(bb_t *bb);
+static void check_owners(bb_t *bb);
+static void check_resize(bb_t *bb);
+static void check_session(bb_t *bb);
+static void check_startup(bb_t *bb);
+static void check_xattrs(bb_t *bb);
 static void cleanup(void);
 static void cleanup_and_raise(int sig);
+static void clear_listing(bb_t *bb);
+static void clear_selected_paths(bb_t *bb);
+static void clear_sort_orders(void);
+static void combine_selection(bb_t *bb, const char *path, char op);
 static int compare_files(const void *v1, const void *v2);
+static int compare_saved_paths(const void *v1, const void *v2);
+static int compare_selected_files(const void *v1, const void *v2);
+static int compare_strings(const void *v1, const void *v2);
+static int copy_bytes(int out_fd, int in_fd, off_t offset, off_t len);
+static void drag_selection(bb_t *bb, int mouse_y);
+static size_t entry_size(entry_t *e);
+static void expire_warnings(bb_t *bb);
 __attribute__((format(printf, 2, 3))) void flash_warn(bb_t *bb, const char *fmt, ...);
+static int handle_mouse_drag(bb_t *bb, int key, int mouse_y);
 static void handle_next_key_binding(bb_t *bb);
+static void handle_rename_key(bb_t *bb, int key);
+static void handle_winch(int sig);
 static void init_term(void);
+static void filter_files(bb_t *bb);
+static void flush_selection(bb_t *bb);
+static selected_file_t *get_selected_files(bb_t *bb, int *count);
 static int is_simple_bbcmd(const char *s);
+static void list_entry(bb_t *bb, entry_t *e);
+static int listed_id(bb_t *bb, int i);
+static int listed_index(bb_t *bb, entry_t *e);
 static entry_t *load_entry(bb_t *bb, const char *path);
+static entry_t *load_entry_at(bb_t *bb, int dirfd, const char *path);
+static entry_t *load_listed_entry(const char *name);
 static int matches_cmd(const char *str, const char *cmd);
+static int matches_globs(const char *globs, const char *name);
+static entry_t *new_entry(bb_t *bb, const char *fullname, const struct stat *info, const char *linkname);
 static char *normalize_path(const char *path, char *pbuf);
 static int populate_files(bb_t *bb, const char *path);
 static void print_bindings(FILE *f);
+static void print_link_groups(bb_t *bb, FILE *f);
+static void print_output(FILE *f, const char *name);
+static char **read_saved_selection(const char *path, int *count);
+static void remove_bindings(binding_t *table, const char *def, char **rebound);
+static void resort_files(bb_t *bb);
+static void resume_listing(bb_t *bb);
+static void resume_session(bb_t *bb, const char *path);
+static entry_t *rename_entry(entry_t *e, const char *path);
 static void run_bbcmd(bb_t *bb, const char *cmd);
 static void restore_term(const struct termios *term);
+static size_t reclaim_sort_orders(size_t want);
 static int run_script(bb_t *bb, const char *cmd);
+static void save_selection(bb_t *bb, const char *path);
+static void save_session(bb_t *bb);
+static void select_listed(bb_t *bb, int start, int end, int selected);
+static void select_matching(bb_t *bb, const char *patterns, int selected);
+static int selected_path_index(bb_t *bb, const char *path);
 static void set_columns(bb_t *bb, const char *cols);
 static void set_cursor(bb_t *bb, int i);
 static void set_globs(bb_t *bb, const char *globs);
@@ -70,10 +164,18 @@ static void set_selected(bb_t *bb, entry_t *e, int selected);
 static void set_scroll(bb_t *bb, int i);
 static void set_sort(bb_t *bb, const char *sort);
 static void set_title(bb_t *bb);
+static void shuffle_files(bb_t *bb);
+static int split_binding(char *def, char **keys, char **script, char **description);
 static void sort_files(bb_t *bb);
+static void start_renaming(bb_t *bb);
+static void stop_renaming(bb_t *bb);
+static int take_selected_path(bb_t *bb, const char *path);
+static int use_cached_sort_order(bb_t *bb);
 static char *trim(char *s);
+static void trim_output_buffers(void);
 static int try_free_entry(entry_t *e);
-static void update_term_size(int sig);
+static void update_term_size(void);
+static void view_selection(bb_t *bb);
 static int wait_for_process(proc_t **proc);
 
 // Constants
@@ -91,20 +193,165 @@ static binding_t bindings[MAX_BINDINGS];
 static struct termios orig_termios, bb_termios;
 static FILE *tty_out = NULL, *tty_in = NULL;
 static struct winsize winsize = {0};
+static volatile sig_atomic_t winch_count = 0;
+
+// The binding definitions that bbkeys sent (as `bind:` commands) the last time
+// it ran, and a signature of the bbkeys files in $PATH at the time, which are
+// watched for changes so bindings can be reloaded without restarting
+static struct {
+    uint64_t signature;
+    char **defs;
+    size_t ndefs;
+    int recording, reloading;
+} bbkeys = {0};
 static char cmdfilename[PATH_MAX] = {0};
+// How much of the command file has been run (while bbstartup is still running)
+static off_t cmdfile_done = 0;
+// bbstartup runs while bb is being used, and the commands from bb's arguments
+// and any keys pressed are held until it's finished loading the key bindings
+static pid_t startup_pid = 0;
+static char *startup_cmds = NULL;
+static size_t startup_cmds_len = 0;
+static struct {
+    int key, mouse_x, mouse_y;
+    struct timespec pressed; // When the key was read, for measuring latency
+} queued_keys[MAX_QUEUED_KEYS];
+static int nqueued_keys = 0;
+// A range of files being selected by dragging the mouse from the file at
+// `anchor` to the file at `end`, where the mouse was last seen, and which
+// files were selected before the drag:
+static struct {
+    int anchor, end, selected, mouse_y;
+    bitset_t original;
+    unsigned int active : 1, moved : 1;
+} drag = {0};
+// The session snapshot being resumed from (only while the first listing is
+// loaded), the next file in the listing to check against the filesystem (or
+// -1 if it's done), and whether there's anything new to save:
+static session_t *resumed = NULL;
+static int verify_next = -1;
+static int session_changed = 0;
+// The next file in the listing to look up the extended attributes of (if
+// they're shown or sorted by):
+static int xattrs_next = 0;
 static bb_t *current_bb = NULL;
-
-// Redirect stderr/stdout to these files during execution, and dump them on exit
+static mempool_t entry_pool = {.name = "File entries"};
+static mempool_t output_pool = {.name = "Script output"};
+static mempool_t sort_pool = {.name = "Sort orders", .reclaim = reclaim_sort_orders};
+
+// Recently used sort orders for the current directory, so that switching
+// between them (or reversing one) doesn't need a full sort
+static struct {
+    char sort[MAX_SORT + 1];
+    unsigned int interleave_dirs : 1;
+    unsigned int lastused;
+    entry_t **order;
+} sort_orders[SORT_CACHE_SIZE] = {0};
+// Incremented whenever a sort order is remembered or reused, for `lastused`:
+static unsigned int sort_clock = 0;
+
+// Redirect stderr/stdout to these in-memory files during execution, keeping
+// only the most recent output, and dump them on exit
 typedef struct {
     int orig_fd, dup_fd, tmp_fd;
     const char *name;
     char filename[PATH_MAX];
+    off_t size, dropped;
 } outbuf_t;
 outbuf_t output_buffers[] = {
     {.name = "stdout", .orig_fd = STDOUT_FILENO, .dup_fd = -1, .tmp_fd = -1},
     {.name = "stderr", .orig_fd = STDERR_FILENO, .dup_fd = -1, .tmp_fd = -1},
 };
 
+//
+// Parse a key binding definition ("<keys>:<script>", as used by `bind:`) and
+// add the bindings to the given binding table. If `in_place` is set, a key
+// that's already bound keeps its position in the table (and the help menu)
+// instead of being moved to the end.
+//
+static void add_bindings(bb_t *bb, binding_t *table, const char *def, int in_place) {
+    char *def_copy = check_strdup(def);
+    char *keys, *script, *description;
+    if (!split_binding(def_copy, &keys, &script, &description)) {
+        if (keys && keys[0]) flash_warn(bb, "No script provided.");
+        delete (&def_copy);
+        return;
+    }
+    for (char *key; (key = strsep(&keys, ","));) {
+        int keyval;
+        binding_t *dest = NULL;
+        if (streq(key, "Section")) {
+            keyval = -1;
+        } else {
+            keyval = bkeywithname(key);
+            if (keyval == -1) continue;
+            // Delete existing bindings for this key (if any):
+            for (binding_t *b = table; b < &table[MAX_BINDINGS] && b->script;) {
+                if (b->key != keyval) {
+                    ++b;
+                    continue;
+                }
+                delete ((char **)&b->description);
+                delete ((char **)&b->script);
+                if (in_place && !dest) {
+                    dest = b++;
+                    continue;
+                }
+                memmove(b, b + 1, sizeof(binding_t) * (size_t)(&table[MAX_BINDINGS - 1] - b));
+                memset(&table[MAX_BINDINGS - 1], 0, sizeof(binding_t));
+            }
+        }
+        // Append binding:
+        for (binding_t *b = table; !dest && b < &table[MAX_BINDINGS]; b++)
+            if (!b->script) dest = b;
+        if (!dest) break;
+        dest->key = keyval;
+        if (is_simple_bbcmd(script)) dest->script = check_strdup(script);
+        else nonnegative(asprintf((char **)&dest->script, "set -e\n%s", script), "Could not copy script");
+        dest->description = check_strdup(description);
+    }
+    delete (&def_copy);
+}
+
+//
+// Move the selected files that are in the current big directory listing (see
+// bigdir.c) and being displayed out of the list of selected files (and paths),
+// so that they're selected by ID.
+//
+static void adopt_selection(bb_t *bb) {
+    size_t len = strlen(bb->path);
+    for (entry_t *next, *e = bb->selected; e; e = next) {
+        next = e->selected.next;
+        if (strncmp(e->fullname, bb->path, len) != 0 || strchr(e->fullname + len, '/')) continue;
+        const char *name = e->fullname + len;
+        int i = bigdir_find(bb->bigdir, name, S_ISDIR(e->info.st_mode));
+        if (i >= bb->nfiles || !streq(bigdir_name(bb->bigdir, i), name)) continue;
+        LL_REMOVE(e, selected);
+        --bb->nselected;
+        bitset_set(&bb->selection, bigdir_id(bb->bigdir, i), 1);
+        try_free_entry(e);
+    }
+    // The paths in this directory are next to each other, and it isn't known
+    // which of them are directories, so both ways are tried:
+    int first = selected_path_index(bb, bb->path), kept = first, i;
+    for (i = first; i < bb->nselected_paths && strncmp(bb->selected_paths[i], bb->path, len) == 0; i++) {
+        const char *name = bb->selected_paths[i] + len;
+        int j = bb->nfiles;
+        for (int isdir = 0; !strchr(name, '/') && isdir <= 1 && j >= bb->nfiles; isdir++) {
+            j = bigdir_find(bb->bigdir, name, isdir);
+            if (j < bb->nfiles && !streq(bigdir_name(bb->bigdir, j), name)) j = bb->nfiles;
+        }
+        if (j < bb->nfiles) {
+            bitset_set(&bb->selection, bigdir_id(bb->bigdir, j), 1);
+            delete (&bb->selected_paths[i]);
+        } else {
+            bb->selected_paths[kept++] = bb->selected_paths[i];
+        }
+    }
+    memmove(&bb->selected_paths[kept], &bb->selected_paths[i], sizeof(char *) * (size_t)(bb->nselected_paths - i));
+    bb->nselected_paths -= i - kept;
+}
+
 //
 // Use bb to browse the filesystem.
 //
@@ -132,40 +379,217 @@ void bb_browse(bb_t *bb, int argc, char *argv[]) {
         goto_file = slash + 1;
     }
 
-    if (populate_files(bb, full_initial_path))
-        errx(EXIT_FAILURE, "Could not find initial path: \"%s\"", full_initial_path);
+    resume_session(bb, full_initial_path);
 
     // Emergency fallback:
     bindings[0].key = KEY_CTRL_C;
     bindings[0].script = check_strdup("kill -INT $PPID");
     bindings[0].description = check_strdup("Kill the bb process");
-    system("bbstartup");
 
-    FILE *cmdfile = fopen(cmdfilename, "a");
-    if (goto_file) fprintf(cmdfile, "%cgoto:%s", '\0', goto_file);
+    // The listing is shown right away, while bbstartup loads the key bindings:
+    bbkeys.signature = bbkeys_signature();
+    bbkeys.recording = 1;
+    if ((startup_pid = nonnegative(fork())) == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        execlp("sh", "sh", "-c", "bbstartup", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (goto_file) {
+        char cmd[PATH_MAX + 8];
+        snprintf(cmd, sizeof(cmd), "goto:%s", goto_file);
+        run_bbcmd(bb, cmd);
+    }
+    FILE *cmds = nonnull(open_memstream(&startup_cmds, &startup_cmds_len));
     for (int i = 0; i < argc; i++) {
         if (argv[i][0] == '+') {
             char *cmd = argv[i] + 1;
             char *colon = strchr(cmd, ':');
             if (colon && !colon[1]) {
                 for (++i; i < argc; i++)
-                    fprintf(cmdfile, "%c%s%s", '\0', cmd, argv[i]);
+                    fprintf(cmds, "%s%s%c", cmd, argv[i], '\0');
             } else {
-                fprintf(cmdfile, "%c%s", '\0', cmd);
+                fprintf(cmds, "%s%c", cmd, '\0');
             }
         }
     }
-    fclose(cmdfile);
+    fclose(cmds);
 
-    check_cmdfile(bb);
     while (!bb->should_quit) {
-        render(tty_out, bb);
+        render(tty_out, bb, winsize.ws_col, winsize.ws_row);
+        latency_painted();
         handle_next_key_binding(bb);
     }
+    if (startup_pid > 0) waitpid(startup_pid, NULL, 0);
+    save_session(bb);
+    xattrs_stop();
+    owners_stop();
+    if (getenv("BBLATENCY") && getenv("BBLATENCY")[0]) {
+        FILE *f = fopen(getenv("BBLATENCY"), "a");
+        if (f) {
+            latency_print_report(f);
+            fclose(f);
+        }
+    }
+#ifdef BB_ALLOC_STATS
+    if (getenv("BBALLOCSTATS") && getenv("BBALLOCSTATS")[0]) {
+        FILE *f = fopen(getenv("BBALLOCSTATS"), "a");
+        if (f) {
+            alloc_print_report(f);
+            fclose(f);
+        }
+    }
+#endif
     system("bbshutdown");
     check_cmdfile(bb);
 }
 
+//
+// Return a signature of all the bbkeys files in $PATH (the first one is the
+// one that's run), which changes when any of them is added, removed, or
+// modified.
+//
+static uint64_t bbkeys_signature(void) {
+    uint64_t signature = 0;
+    const char *dirs = getenv("PATH");
+    for (const char *dir = dirs ? dirs : "", *end; *dir; dir = end + (*end ? 1 : 0)) {
+        end = strchrnul(dir, ':');
+        char path[PATH_MAX];
+        struct stat info;
+        snprintf(path, sizeof(path), "%.*s/bbkeys", (int)(end - dir), dir);
+        if (end == dir || stat(path, &info) != 0) continue;
+        struct {
+            uint64_t signature;
+            dev_t dev;
+            ino_t ino;
+            off_t size;
+            struct timespec mtime;
+        } file;
+        memset(&file, 0, sizeof(file));
+        file.signature = signature;
+        file.dev = info.st_dev, file.ino = info.st_ino, file.size = info.st_size;
+        file.mtime = get_mtime(info);
+        signature = hash_bytes(&file, sizeof(file));
+    }
+    return signature;
+}
+
+//
+// Return whether a key binding definition ("<keys>:<script>") binds a key.
+//
+static int binds_key(const char *def, int keyval) {
+    char *def_copy = check_strdup(def);
+    char *keys, *script, *description;
+    int found = 0;
+    if (split_binding(def_copy, &keys, &script, &description)) {
+        for (char *key; !found && (key = strsep(&keys, ","));)
+            found = !streq(key, "Section") && bkeywithname(key) == keyval;
+    }
+    delete (&def_copy);
+    return found;
+}
+
+//
+// If any bbkeys file in $PATH has changed since bbkeys last ran, run it again
+// and rebind only the definitions it sent that were added, changed, or removed
+// since the last time. The new bindings are built in a copy of the binding
+// table, which then replaces the live table all at once.
+//
+static void check_bindings_file(bb_t *bb) {
+    static struct timespec last_check = {0};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (last_check.tv_sec && now.tv_sec - last_check.tv_sec < BINDINGS_CHECK_INTERVAL) return;
+    last_check = now;
+
+    uint64_t signature = bbkeys_signature();
+    if (signature == bbkeys.signature) return;
+    bbkeys.signature = signature;
+
+    // The `bind:` commands are recorded instead of run (see run_bbcmd()):
+    char **defs = bbkeys.defs;
+    bbkeys.defs = NULL;
+    bbkeys.ndefs = 0;
+    bbkeys.recording = bbkeys.reloading = 1;
+    pid_t pid = nonnegative(fork());
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) dup2(devnull, STDIN_FILENO);
+        execlp("sh", "sh", "-c", "bbkeys", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    waitpid(pid, NULL, 0);
+    check_cmdfile(bb);
+    bbkeys.recording = bbkeys.reloading = 0;
+
+    // If bbkeys didn't send any bindings (e.g. while it's being edited), the
+    // current ones are kept:
+    if (!bbkeys.defs) {
+        bbkeys.defs = defs;
+        for (bbkeys.ndefs = 0; defs && defs[bbkeys.ndefs];)
+            ++bbkeys.ndefs;
+        return;
+    }
+
+    static binding_t next[MAX_BINDINGS];
+    memcpy(next, bindings, sizeof(next));
+    char **added = new (char * [bbkeys.ndefs + 1]);
+    for (size_t i = 0, nadded = 0; i < bbkeys.ndefs; i++) {
+        int found = 0;
+        for (char **old = defs; old && *old && !found; old++)
+            found = streq(bbkeys.defs[i], *old);
+        if (!found) added[nadded++] = bbkeys.defs[i];
+    }
+    // Keys that are bound again are left in place for add_bindings() to replace:
+    for (char **old = defs; old && *old; old++) {
+        int found = 0;
+        for (char **d = bbkeys.defs; *d && !found; d++)
+            found = streq(*d, *old);
+        if (!found) remove_bindings(next, *old, added);
+    }
+    for (char **d = added; *d; d++)
+        add_bindings(bb, next, *d, 1);
+    delete (&added);
+    memcpy(bindings, next, sizeof(bindings));
+    for (char **old = defs; old && *old; old++)
+        delete (old);
+    delete (&defs);
+}
+
+//
+// Remember the current order of bb->loaded for the current sort settings,
+// replacing the least recently used remembered order if necessary.
+//
+static void cache_sort_order(bb_t *bb) {
+    if (columns_have_cache(bb->sort, COLUMN_VOLATILE) || bb->nloaded < 2) return;
+    size_t size = (size_t)bb->nloaded * sizeof(entry_t *);
+    int lru = 0;
+    for (int i = 1; i < SORT_CACHE_SIZE; i++)
+        if (sort_orders[i].lastused < sort_orders[lru].lastused) lru = i;
+    if (sort_orders[lru].order) {
+        delete (&sort_orders[lru].order);
+        mem_release(&sort_pool, size);
+    }
+    if (!mem_can_grow(size)) return;
+    sort_orders[lru].order = memcpy(new_bytes(size), bb->loaded, size);
+    mem_charge(&sort_pool, size);
+    strcpy(sort_orders[lru].sort, bb->sort);
+    sort_orders[lru].interleave_dirs = bb->interleave_dirs;
+    sort_orders[lru].lastused = ++sort_clock;
+}
+
+//
+// If any of the columns shown change as time passes (e.g. "5 minutes"),
+// redraw the rows that have changed once a second.
+//
+static void check_clock(bb_t *bb) {
+    static time_t last_tick = 0;
+    if (!columns_have_cache(bb->columns, COLUMN_CLOCK) || time(NULL) == last_tick) return;
+    last_tick = time(NULL);
+    bb->listing_changed = 1;
+}
+
 //
 // Check the bb command file and run any and all commands that have been
 // written to it.
@@ -173,16 +597,148 @@ void bb_browse(bb_t *bb, int argc, char *argv[]) {
 static void check_cmdfile(bb_t *bb) {
     FILE *cmdfile = fopen(cmdfilename, "r");
     if (!cmdfile) return;
+    fseeko(cmdfile, cmdfile_done, SEEK_SET);
     char *cmd = NULL;
     size_t space = 0;
-    while (getdelim(&cmd, &space, '\0', cmdfile) >= 0) {
+    ssize_t len;
+    while ((len = getdelim(&cmd, &space, '\0', cmdfile)) >= 0) {
+        // bbstartup may still be in the middle of writing the last command:
+        if (startup_pid > 0 && cmd[len - 1] != '\0') break;
+        cmdfile_done += len;
         if (!cmd[0]) continue;
         run_bbcmd(bb, cmd);
         if (bb->should_quit) break;
     }
     delete (&cmd);
     fclose(cmdfile);
+    // bbstartup may still write more commands, so the file is kept until it's done:
+    if (startup_pid > 0) return;
     unlink(cmdfilename);
+    cmdfile_done = 0;
+}
+
+//
+// If user or group names that were being looked up have come in, show them,
+// and if the files are sorted by them, re-sort (at most once a second until
+// all the names are in).
+//
+static void check_owners(bb_t *bb) {
+    if (owners_update() == 0) return;
+    bb->listing_changed = 1;
+    static time_t last_sort = 0;
+    if (!(columns_needs(bb->sort) & COLUMN_NEEDS_OWNERS) || bb->bigdir) return;
+    if (owners_backlog() > 0 && time(NULL) == last_sort) return;
+    last_sort = time(NULL);
+    resort_files(bb);
+}
+
+//
+// If the terminal has been resized and no more resize events have arrived for
+// RESIZE_SETTLE_MS, update the cached terminal size. This coalesces the storm
+// of SIGWINCH events that happens while dragging a window edge into a single
+// redraw.
+//
+static void check_resize(bb_t *bb) {
+    static sig_atomic_t seen = 0;
+    static struct timespec last_change;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (winch_count != seen) {
+        seen = winch_count;
+        last_change = now;
+        return;
+    }
+    if (last_change.tv_sec == 0 && last_change.tv_nsec == 0) return;
+    double elapsed_ms =
+        1e3 * (double)(now.tv_sec - last_change.tv_sec) + 1e-6 * (double)(now.tv_nsec - last_change.tv_nsec);
+    if (elapsed_ms < RESIZE_SETTLE_MS) return;
+    last_change.tv_sec = last_change.tv_nsec = 0;
+    struct winsize prevsize = winsize;
+    update_term_size();
+    if (winsize.ws_row != prevsize.ws_row || winsize.ws_col != prevsize.ws_col) bb->dirty = 1;
+}
+
+//
+// If the listing was resumed from a session snapshot, check the next batch of
+// its files to see whether they've changed since the snapshot was made, and
+// reload the listing if any have. Every so often, save a new snapshot.
+//
+static void check_session(bb_t *bb) {
+    for (int n = 0; verify_next >= 0 && n < SESSION_VERIFY_BATCH; n++) {
+        if (verify_next >= bb->nloaded) {
+            verify_next = -1;
+            break;
+        }
+        entry_t *e = bb->loaded[verify_next++];
+        struct stat info;
+        if (lstat(e->fullname, &info) != 0 || info.st_ino != e->info.st_ino || info.st_dev != e->info.st_dev
+            || info.st_size != e->info.st_size || info.st_mode != e->info.st_mode
+            || memcmp(&get_mtime(info), &get_mtime(e->info), sizeof(struct timespec)) != 0
+            || memcmp(&get_ctime(info), &get_ctime(e->info), sizeof(struct timespec)) != 0) {
+            populate_files(bb, bb->path);
+            break;
+        }
+    }
+
+    static time_t last_save = 0;
+    time_t now = time(NULL);
+    if (!last_save) last_save = now;
+    if (session_changed && now - last_save >= SESSION_SAVE_INTERVAL) {
+        save_session(bb);
+        last_save = now;
+    }
+}
+
+//
+// If bbstartup is running, run the commands it has written so far. Once it
+// has finished, run the commands from bb's arguments, and the keys that were
+// pressed in the meantime will be handled (see handle_next_key_binding()).
+//
+static void check_startup(bb_t *bb) {
+    if (startup_pid <= 0) return;
+    int status;
+    if (waitpid(startup_pid, &status, WNOHANG) == 0) {
+        check_cmdfile(bb);
+        return;
+    }
+    startup_pid = 0;
+    trim_output_buffers();
+    check_cmdfile(bb);
+    bbkeys.recording = 0;
+    if (startup_cmds_len > 0) {
+        FILE *cmdfile = fopen(cmdfilename, "a");
+        if (cmdfile) {
+            fwrite(startup_cmds, 1, startup_cmds_len, cmdfile);
+            fclose(cmdfile);
+        }
+    }
+    delete (&startup_cmds);
+    startup_cmds_len = 0;
+    check_cmdfile(bb);
+    bb->dirty = 1;
+}
+
+//
+// If extended attributes are shown (or sorted by), look up the rest of the
+// listing's files in the background, and show the results that have come in.
+// The files being drawn are looked up first (see col_xattrs()).
+//
+static void check_xattrs(bb_t *bb) {
+    int wanted = (columns_needs(bb->columns) | columns_needs(bb->sort)) & COLUMN_NEEDS_XATTRS;
+    if (!wanted && xattrs_backlog() == 0) return;
+    while (wanted && !bb->bigdir && xattrs_next < bb->nfiles && xattrs_backlog() < XATTRS_BACKLOG)
+        xattrs_get(bb->files[xattrs_next++], 0);
+    if (xattrs_update() == 0) return;
+    bb->listing_changed = 1;
+
+    // Re-sorting is only done once a second until all the results are in:
+    static time_t last_sort = 0;
+    if (!(columns_needs(bb->sort) & COLUMN_NEEDS_XATTRS) || bb->bigdir) return;
+    if (xattrs_backlog() > 0 && time(NULL) == last_sort) return;
+    last_sort = time(NULL);
+    resort_files(bb);
+    // Files that haven't been looked up may have moved before xattrs_next:
+    xattrs_next = 0;
 }
 
 //
@@ -221,14 +777,129 @@ static void cleanup(void) {
         if (ob->tmp_fd == -1) continue;
         fflush(ob->orig_fd == STDOUT_FILENO ? stdout : stderr);
         dup2(ob->dup_fd, ob->orig_fd);
-        lseek(ob->tmp_fd, 0, SEEK_SET);
-        char buf[256];
-        for (ssize_t len; (len = read(ob->tmp_fd, buf, LEN(buf))) > 0;)
-            write(ob->orig_fd, buf, len);
+        if (ob->dropped > 0)
+            dprintf(STDERR_FILENO, BB_NAME ": the first %lld bytes of %s were dropped\n", (long long)ob->dropped,
+                    ob->name);
+        struct stat info;
+        if (fstat(ob->tmp_fd, &info) == 0) copy_bytes(ob->orig_fd, ob->tmp_fd, 0, info.st_size);
         close(ob->tmp_fd);
         ob->tmp_fd = ob->dup_fd = -1;
-        unlink(ob->filename);
+        if (ob->filename[0]) unlink(ob->filename);
+    }
+}
+
+//
+// Remove all the files in the current listing (if any), freeing the entries
+// that aren't needed anymore.
+//
+static void clear_listing(bb_t *bb) {
+    verify_next = -1;
+    xattrs_next = 0;
+    drag.active = 0;
+    if (bb->renaming) { // The new names are kept by the listing's IDs
+        rename_free(bb->renaming);
+        bb->renaming = NULL;
+    }
+    if (bb->bigdir) {
+        bigdir_close(bb->bigdir);
+        bb->bigdir = NULL;
+    }
+    for (int i = 0; i < bb->nloaded; i++) {
+        entry_t *e = bb->loaded[i];
+        if (bb->viewing_selection) // Entries are shown by their full path in the selection view
+            e->name = streq(e->fullname, "/") ? e->fullname : strrchr(e->fullname, '/') + 1;
+        e->index = -1;
+        e->listed = 0;
+        try_free_entry(e);
+    }
+    delete (&bb->loaded);
+    delete (&bb->files);
+    bb->nfiles = bb->nloaded = 0;
+    bb->cursor = 0;
+    bb->scroll = 0;
+    bb->viewing_selection = 0;
+}
+
+//
+// Deselect the files that are selected by path (see flush_selection()).
+//
+static void clear_selected_paths(bb_t *bb) {
+    while (bb->nselected_paths > 0)
+        delete (&bb->selected_paths[--bb->nselected_paths]);
+    delete (&bb->selected_paths);
+}
+
+//
+// Forget the remembered sort orders (e.g. because the files have changed).
+//
+static void clear_sort_orders(void) {
+    FOREACH(__typeof__(&sort_orders[0]), o, sort_orders) {
+        delete (&o->order);
+        o->lastused = 0;
+    }
+    mem_release(&sort_pool, sort_pool.used);
+}
+
+//
+// Combine the current selection with the selection saved in the file at
+// `path` (see save_selection()): '+' for the union, '&' for the intersection,
+// or '-' for the difference. Both selections are sorted the same way, so this
+// is done by merging them, and the saved files that need to be loaded are
+// loaded one directory at a time.
+//
+static void combine_selection(bb_t *bb, const char *path, char op) {
+    int nsaved, nlive;
+    char **saved = read_saved_selection(path, &nsaved);
+    if (!saved) {
+        flash_warn(bb, "Could not read saved selection: \"%s\"", path);
+        return;
+    }
+    selected_file_t *live = get_selected_files(bb, &nlive);
+    int missing = 0, dirfd = -1;
+    char dir[PATH_MAX] = "";
+    for (int i = 0, j = 0; i < nlive || j < nsaved;) {
+        int cmp = i >= nlive ? 1 : (j >= nsaved ? -1 : compare_paths(live[i].path, saved[j]));
+        if (cmp <= 0) { // Selected now (and saved, if cmp == 0)
+            if ((cmp < 0 && op == '&') || (cmp == 0 && op == '-')) {
+                if (live[i].entry) set_selected(bb, live[i].entry, 0);
+                else if (live[i].id >= 0) bitset_set(&bb->selection, live[i].id, 0);
+                else take_selected_path(bb, live[i].path);
+            }
+            i += 1;
+            j += (cmp == 0);
+        } else { // Only saved
+            const char *slash = strrchr(saved[j], '/');
+            if (op == '+' && slash) {
+                int dirlen = (int)(slash - saved[j]);
+                if (dirfd < 0 || strncmp(dir, saved[j], (size_t)dirlen) != 0 || dir[dirlen]) {
+                    if (dirfd >= 0) close(dirfd);
+                    snprintf(dir, sizeof(dir), "%.*s", dirlen, saved[j]);
+                    dirfd = open(dirlen > 0 ? dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                }
+                entry_t *e = dirfd >= 0 ? load_entry_at(bb, dirfd, saved[j]) : NULL;
+                int index = e && bb->bigdir && !IS_LISTED(e) ? listed_index(bb, e) : -1;
+                if (!e) {
+                    ++missing;
+                } else if (index >= 0) { // Not in the window of a big directory listing
+                    bitset_set(&bb->selection, bigdir_id(bb->bigdir, index), 1);
+                    try_free_entry(e);
+                } else {
+                    set_selected(bb, e, 1);
+                }
+            }
+            j += 1;
+        }
     }
+    if (dirfd >= 0) close(dirfd);
+    if (missing)
+        flash_warn(bb, "%d saved file%s no longer exist%s", missing, missing == 1 ? "" : "s", missing == 1 ? "s" : "");
+    for (int i = 0; i < nlive; i++)
+        if (!live[i].entry) delete (&live[i].path);
+    delete (&live);
+    for (int j = 0; j < nsaved; j++)
+        delete (&saved[j]);
+    delete (&saved);
+    bb->dirty = 1;
 }
 
 //
@@ -240,9 +911,8 @@ static int compare_files(const void *v1, const void *v2) {
     if ((a) != (b)) {                                                                                                  \
         return sign * ((a) < (b) ? 1 : -1);                                                                            \
     }
-#define COMPARE_TIME(t1, t2) COMPARE((t1).tv_sec, (t2).tv_sec) COMPARE((t1).tv_nsec, (t2).tv_nsec)
     bb_t *bb = current_bb;
-    const entry_t *e1 = *((const entry_t **)v1), *e2 = *((const entry_t **)v2);
+    entry_t *e1 = *((entry_t **)v1), *e2 = *((entry_t **)v2);
 
     int sign = 1;
     if (!bb->interleave_dirs) {
@@ -251,85 +921,319 @@ static int compare_files(const void *v1, const void *v2) {
 
     for (char *sort = bb->sort + 1; *sort; sort += 2) {
         sign = sort[-1] == '-' ? -1 : 1;
-        switch (*sort) {
-        case COL_SELECTED: COMPARE(IS_SELECTED(e1), IS_SELECTED(e2)); break;
-        case COL_NAME: {
-            // This sorting method is not identical to strverscmp(). Notably, bb's sort
-            // will order: [0, 1, 9, 00, 01, 09, 10, 000, 010] instead of strverscmp()'s
-            // order: [000, 00, 01, 010, 09, 0, 1, 9, 10]. I believe bb's sort is consistent
-            // with how people want their files grouped: all files padded to n digits
-            // will be grouped together, and files with the same padding will be sorted
-            // ordinally. This version also does case-insensitivity by lowercasing words,
-            // so the following characters come before all letters: [\]^_`
-            const char *n1 = e1->name, *n2 = e2->name;
-            while (*n1 && *n2) {
-                char c1 = tolower(*n1), c2 = tolower(*n2);
-                if ('0' <= c1 && c1 <= '9' && '0' <= c2 && c2 <= '9') {
-                    long i1 = strtol(n1, (char **)&n1, 10);
-                    long i2 = strtol(n2, (char **)&n2, 10);
-                    // Shorter numbers always go before longer. In practice, I assume
-                    // filenames padded to the same number of digits should be grouped
-                    // together, instead of
-                    // [1.png, 0001.png, 2.png, 0002.png, 3.png], it makes more sense to have:
-                    // [1.png, 2.png, 3.png, 0001.png, 0002.png]
-                    COMPARE((n2 - e2->name), (n1 - e1->name));
-                    COMPARE(i2, i1);
-                } else {
-                    COMPARE(c2, c1);
-                    ++n1;
-                    ++n2;
-                }
-            }
-            COMPARE(tolower(*n2), tolower(*n1));
-            break;
-        }
-        case COL_PERM: COMPARE((e1->info.st_mode & 0x3FF), (e2->info.st_mode & 0x3FF)); break;
-        case COL_SIZE: COMPARE(e1->info.st_size, e2->info.st_size); break;
-        case COL_MTIME: COMPARE_TIME(get_mtime(e1->info), get_mtime(e2->info)); break;
-        case COL_CTIME: COMPARE_TIME(get_ctime(e1->info), get_ctime(e2->info)); break;
-        case COL_ATIME: COMPARE_TIME(get_atime(e1->info), get_atime(e2->info)); break;
-        case COL_RANDOM: COMPARE(e2->shufflepos, e1->shufflepos); break;
-        default: break;
-        }
+        const column_t *col = &column_info[(int)*sort];
+        if (!col->compare) continue;
+        int cmp = col->compare(bb, e1, e2);
+        if (cmp) return sign * cmp;
     }
     return 0;
 #undef COMPARE
-#undef COMPARE_TIME
+}
+
+static int compare_saved_paths(const void *v1, const void *v2) {
+    return compare_paths(*(char *const *)v1, *(char *const *)v2);
+}
+
+static int compare_selected_files(const void *v1, const void *v2) {
+    return compare_paths(((const selected_file_t *)v1)->path, ((const selected_file_t *)v2)->path);
+}
+
+static int compare_strings(const void *v1, const void *v2) { return strcmp(*(char *const *)v1, *(char *const *)v2); }
+
+//
+// Copy `len` bytes starting at `offset` from one file to another, using
+// sendfile() where possible and large blocks otherwise. Return 0 on success.
+//
+static int copy_bytes(int out_fd, int in_fd, off_t offset, off_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        ssize_t sent = sendfile(out_fd, in_fd, &offset, (size_t)len);
+        if (sent <= 0) break;
+        len -= sent;
+    }
+    if (len == 0) return 0;
+#endif
+    static char buf[1 << 16];
+    while (len > 0) {
+        ssize_t got = pread(in_fd, buf, (size_t)MIN(len, (off_t)sizeof(buf)), offset);
+        if (got <= 0) return -1;
+        for (ssize_t written = 0, w; written < got; written += w)
+            if ((w = write(out_fd, buf + written, (size_t)(got - written))) < 0) return -1;
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+//
+// Extend the range of files being selected by dragging the mouse to the file
+// at row `mouse_y`, or scroll by a line when the mouse is above or below the
+// listing. Only the files between the old and new ends of the range change.
+//
+static void drag_selection(bb_t *bb, int mouse_y) {
+    int index;
+    if (mouse_y < 2) {
+        set_scroll(bb, bb->scroll - 1);
+        index = bb->scroll;
+    } else if (mouse_y > winsize.ws_row - 2) {
+        set_scroll(bb, bb->scroll + 1);
+        index = bb->scroll + ONSCREEN - 1;
+    } else {
+        index = bb->scroll + (mouse_y - 2);
+    }
+    index = MAX(0, MIN(index, bb->nfiles - 1));
+    bb->cursor = index;
+    bb->dirty = 1;
+    if (index == drag.end) return;
+
+    if (!drag.moved) { // The file where the drag started is toggled and the range gets its new state
+        drag.moved = 1;
+        bitset_resize(&drag.original, bb->selection.nbits);
+        bitset_load(&drag.original, bb->selection.words);
+        drag.selected = !BITSET_GET(&bb->selection, listed_id(bb, drag.anchor));
+        select_listed(bb, drag.anchor, drag.anchor + 1, drag.selected);
+    }
+    int lo = MIN(drag.anchor, drag.end), hi = MAX(drag.anchor, drag.end);
+    int newlo = MIN(drag.anchor, index), newhi = MAX(drag.anchor, index);
+    // Both ranges include the anchor, so they differ only at their ends, and
+    // files that are no longer in the range go back to how they were:
+    for (int i = lo; i < newlo; i++)
+        bitset_set(&bb->selection, listed_id(bb, i), BITSET_GET(&drag.original, listed_id(bb, i)));
+    for (int i = newhi + 1; i <= hi; i++)
+        bitset_set(&bb->selection, listed_id(bb, i), BITSET_GET(&drag.original, listed_id(bb, i)));
+    if (newlo < lo) select_listed(bb, newlo, lo, drag.selected);
+    if (newhi > hi) select_listed(bb, hi + 1, newhi + 1, drag.selected);
+    drag.end = index;
+}
+
+//
+// Return the number of bytes allocated for an entry by load_entry()
+//
+static size_t entry_size(entry_t *e) {
+    return sizeof(entry_t) + strlen(e->fullname) + 1 + (e->linkname ? strlen(e->linkname) + 1 : 0);
 }
 
 //
-// Flash a warning message at the bottom of the screen.
+// Stop showing warnings that have been shown for long enough.
+//
+static void expire_warnings(bb_t *bb) {
+    time_t now = time(NULL);
+    FOREACH(warning_t *, w, bb->warnings) {
+        if (w->count > 0 && now - w->time >= WARNING_SECONDS) {
+            w->count = 0;
+            bb->dirty = 1;
+        }
+    }
+}
+
+//
+// Update bb->files to hold the loaded files (in sorted order) that match bb's
+// globs, and update their indices.
+//
+static void filter_files(bb_t *bb) {
+    if (bb->bigdir) {
+        bigdir_filter(bb->bigdir, matches_globs, bb->globpats, -1);
+        bb->nfiles = bb->bigdir->nshown;
+        adopt_selection(bb);
+        return;
+    }
+    bb->files = grow(bb->files, (size_t)MAX(bb->nloaded, 1));
+    bb->nfiles = 0;
+    for (int i = 0; i < bb->nloaded; i++) {
+        entry_t *e = bb->loaded[i];
+        if (!bb->loaded_all || matches_globs(bb->globpats, e->name)) {
+            e->index = bb->nfiles;
+            bb->files[bb->nfiles++] = e;
+        } else {
+            e->index = -1;
+        }
+    }
+    bb->dirty = 1;
+}
+
+//
+// Show a warning message in the status line for a few seconds (without
+// waiting for the user). If there's already a warning with the same format
+// string, it's replaced by this one and its count goes up, so a burst of
+// similar warnings only takes up one spot.
 //
 void flash_warn(bb_t *bb, const char *fmt, ...) {
-    move_cursor(tty_out, 0, winsize.ws_row - 1);
-    fputs("\033[41;33;1m", tty_out);
+    int i = 0;
+    while (i < MAX_WARNINGS - 1 && !(bb->warnings[i].count > 0 && bb->warnings[i].fmt == fmt))
+        ++i;
+    int count = bb->warnings[i].fmt == fmt ? bb->warnings[i].count : 0;
+    memmove(&bb->warnings[1], &bb->warnings[0], sizeof(warning_t) * (size_t)i);
+    warning_t *w = &bb->warnings[0];
+    w->fmt = fmt;
+    w->count = count + 1;
+    w->time = time(NULL);
     va_list args;
     va_start(args, fmt);
-    vfprintf(tty_out, fmt, args);
+    vsnprintf(w->message, sizeof(w->message), fmt, args);
     va_end(args);
-    fputs(" Press any key to continue...\033[0m  ", tty_out);
-    fflush(tty_out);
-    while (bgetkey(tty_in, NULL, NULL) == -1)
-        usleep(100);
     bb->dirty = 1;
 }
 
+//
+// Move the selected files in the current listing into the list of selected
+// files (in the order they're listed), e.g. before leaving the listing. The
+// selected files in a big directory listing are kept as paths instead, since
+// there could be too many of them to load, and they're loaded when they're
+// needed (see load_entry_at() and view_selection()).
+//
+static void flush_selection(bb_t *bb) {
+    if (bb->selection.count == 0) return;
+    if (bb->bigdir) {
+        bb->selected_paths = grow(bb->selected_paths, (size_t)(bb->nselected_paths + bb->selection.count));
+        for (int id = bitset_next(&bb->selection, 0); id >= 0; id = bitset_next(&bb->selection, id + 1))
+            nonnegative(asprintf(&bb->selected_paths[bb->nselected_paths++], "%s%s", bb->path,
+                                 bigdir_id_name(bb->bigdir, id)));
+        qsort(bb->selected_paths, (size_t)bb->nselected_paths, sizeof(char *), compare_strings);
+        int n = 0;
+        for (int i = 0; i < bb->nselected_paths; i++) {
+            if (n > 0 && streq(bb->selected_paths[i], bb->selected_paths[n - 1])) delete (&bb->selected_paths[i]);
+            else bb->selected_paths[n++] = bb->selected_paths[i];
+        }
+        bb->nselected_paths = n;
+    } else {
+        for (int i = 0; i < bb->nloaded; i++) {
+            entry_t *e = bb->loaded[i];
+            if (!BITSET_GET(&bb->selection, e->id)) continue;
+            LL_PREPEND(bb->selected, e, selected);
+            ++bb->nselected;
+        }
+    }
+    bitset_set_range(&bb->selection, 0, bb->selection.nbits, 0);
+}
+
+//
+// Return a list of all the selected files, sorted by compare_paths(), and store
+// how many there are in `count`. Paths of files without entries are allocated
+// and need to be freed by the caller (along with the list).
+//
+static selected_file_t *get_selected_files(bb_t *bb, int *count) {
+    selected_file_t *files =
+        new (selected_file_t[(size_t)(bb->nselected + bb->nselected_paths + bb->selection.count + 1)]);
+    int n = 0;
+    for (entry_t *e = bb->selected; e; e = e->selected.next)
+        files[n++] = (selected_file_t){.path = e->fullname, .entry = e, .id = -1};
+    for (int i = 0; i < bb->nselected_paths; i++)
+        files[n++] = (selected_file_t){.path = check_strdup(bb->selected_paths[i]), .id = -1};
+    if (bb->bigdir) {
+        for (int id = bitset_next(&bb->selection, 0); id >= 0; id = bitset_next(&bb->selection, id + 1)) {
+            files[n] = (selected_file_t){.id = id};
+            nonnegative(asprintf(&files[n++].path, "%s%s", bb->path, bigdir_id_name(bb->bigdir, id)));
+        }
+    } else {
+        for (int i = 0; i < bb->nloaded; i++) {
+            entry_t *e = bb->loaded[i];
+            if (IS_SELECTED(bb, e)) files[n++] = (selected_file_t){.path = e->fullname, .entry = e, .id = e->id};
+        }
+    }
+    qsort(files, (size_t)n, sizeof(selected_file_t), compare_selected_files);
+    *count = n;
+    return files;
+}
+
+//
+// Select files by dragging the mouse over them (unless "Left drag" has a key
+// binding), and return whether the key was handled. A drag starts with a left
+// press on a file and selects (or deselects, if that file was selected) every
+// file from there to the mouse. Drag events that are already waiting to be
+// read are skipped in favor of the latest one, so the listing is only redrawn
+// once however fast the mouse moves.
+//
+static int handle_mouse_drag(bb_t *bb, int key, int mouse_y) {
+    if (key == MOUSE_LEFT_PRESS) {
+        drag.active = !bb->renaming && 2 <= mouse_y && mouse_y <= winsize.ws_row - 2
+                      && bb->scroll + (mouse_y - 2) < bb->nfiles;
+        FOREACH(binding_t *, b, bindings) {
+            if (b->key == MOUSE_LEFT_DRAG) drag.active = 0;
+        }
+        drag.anchor = drag.end = bb->scroll + (mouse_y - 2);
+        drag.moved = 0;
+        return 0;
+    } else if (key == MOUSE_LEFT_DRAG && drag.active) {
+        struct pollfd pfd = {.fd = fileno(tty_in), .events = POLLIN};
+        while (nqueued_keys < MAX_QUEUED_KEYS && poll(&pfd, 1, 0) == 1) {
+            int mouse_x, y;
+            int next = bgetkey(tty_in, &mouse_x, &y);
+            if (next == MOUSE_LEFT_DRAG) {
+                mouse_y = y;
+            } else if (next != -1) { // Handled after this drag event
+                memmove(queued_keys + 1, queued_keys, sizeof(queued_keys[0]) * (size_t)nqueued_keys++);
+                queued_keys[0] = (__typeof__(queued_keys[0])){next, mouse_x, y, {0}};
+                clock_gettime(CLOCK_MONOTONIC, &queued_keys[0].pressed);
+                break;
+            }
+        }
+        drag.mouse_y = mouse_y;
+        drag_selection(bb, mouse_y);
+        return 1;
+    } else if (key == MOUSE_LEFT_RELEASE && drag.active) {
+        // Releasing the mouse after dragging isn't a click:
+        drag.active = 0;
+        return drag.moved;
+    }
+    return 0;
+}
+
 //
 // Wait until the user has pressed a key with an associated key binding and run
 // that binding.
 //
 static void handle_next_key_binding(bb_t *bb) {
     int key, mouse_x, mouse_y;
+    struct timespec pressed;
     binding_t *binding;
     do {
         do {
-            struct winsize prevsize = winsize;
+            if (startup_pid <= 0 && nqueued_keys > 0) { // Pressed while bbstartup was running
+                key = queued_keys[0].key;
+                mouse_x = queued_keys[0].mouse_x, mouse_y = queued_keys[0].mouse_y;
+                pressed = queued_keys[0].pressed;
+                memmove(queued_keys, queued_keys + 1, sizeof(queued_keys[0]) * (size_t)--nqueued_keys);
+                break;
+            }
             key = bgetkey(tty_in, &mouse_x, &mouse_y);
+            clock_gettime(CLOCK_MONOTONIC, &pressed);
+            if (key == -1) {
+                mem_check_pressure();
+                trim_output_buffers();
+                if (startup_pid > 0) check_startup(bb);
+                else check_bindings_file(bb);
+                check_session(bb);
+                check_clock(bb);
+                check_xattrs(bb);
+                check_owners(bb);
+                expire_warnings(bb);
+                // Keep scrolling while the mouse is held above or below the listing:
+                if (drag.active && drag.moved && (drag.mouse_y < 2 || drag.mouse_y > winsize.ws_row - 2))
+                    drag_selection(bb, drag.mouse_y);
+            } else if (startup_pid > 0 && key != KEY_CTRL_C) {
+                // The key bindings are still loading, so only the fallback works:
+                if (nqueued_keys < MAX_QUEUED_KEYS)
+                    queued_keys[nqueued_keys++] = (__typeof__(queued_keys[0])){key, mouse_x, mouse_y, pressed};
+                key = -1;
+                check_startup(bb);
+            }
             // Window size changed while waiting for keypress:
-            if (winsize.ws_row != prevsize.ws_row || winsize.ws_col != prevsize.ws_col) bb->dirty = 1;
-            if (key == -1 && bb->dirty) return;
+            check_resize(bb);
+            if (key == -1 && (bb->dirty || bb->listing_changed)) return;
         } while (key == -1);
 
+        if (bb->renaming) {
+            latency_start(pressed, LATENCY_BBCMD);
+            handle_rename_key(bb, key);
+            return;
+        }
+
+        if (handle_mouse_drag(bb, key, mouse_y)) {
+            latency_start(pressed, LATENCY_BBCMD);
+            session_changed = 1;
+            return;
+        }
+
         binding = NULL;
         FOREACH(binding_t *, b, bindings) {
             if (key == b->key) {
@@ -353,7 +1257,7 @@ static void handle_next_key_binding(bb_t *bb) {
         if (mouse_y == 1) {
             strcpy(bbclicked, "<column label>");
         } else if (2 <= mouse_y && mouse_y <= winsize.ws_row - 2 && bb->scroll + (mouse_y - 2) <= bb->nfiles - 1) {
-            strcpy(bbclicked, bb->files[bb->scroll + (mouse_y - 2)]->fullname);
+            strcpy(bbclicked, FILE_AT(bb, bb->scroll + (mouse_y - 2))->fullname);
         } else {
             bbclicked[0] = '\0';
         }
@@ -361,6 +1265,8 @@ static void handle_next_key_binding(bb_t *bb) {
         setenv("BBCLICKED", bbclicked, 1);
     }
 
+    latency_start(pressed, is_simple_bbcmd(binding->script) ? LATENCY_BBCMD : LATENCY_SCRIPT);
+    session_changed = 1;
     if (is_simple_bbcmd(binding->script)) {
         run_bbcmd(bb, binding->script);
     } else {
@@ -368,11 +1274,21 @@ static void handle_next_key_binding(bb_t *bb) {
         fputs("\033[K", tty_out);
         restore_term(&orig_termios);
         run_script(bb, binding->script);
+        trim_output_buffers();
         for (entry_t *next, *e = bb->selected; e; e = next) {
             next = e->selected.next;
             struct stat buf;
             if (stat(e->fullname, &buf) != 0) set_selected(bb, e, 0);
         }
+        for (int i = bb->nselected_paths - 1; i >= 0; i--) {
+            struct stat buf;
+            if (stat(bb->selected_paths[i], &buf) != 0) take_selected_path(bb, bb->selected_paths[i]);
+        }
+        for (int i = 0; bb->selection.count > 0 && !bb->bigdir && i < bb->nloaded; i++) {
+            struct stat buf;
+            if (IS_SELECTED(bb, bb->loaded[i]) && stat(bb->loaded[i]->fullname, &buf) != 0)
+                set_selected(bb, bb->loaded[i], 0);
+        }
         init_term();
         set_title(bb);
         check_cmdfile(bb);
@@ -383,13 +1299,54 @@ static void handle_next_key_binding(bb_t *bb) {
     }
 }
 
+//
+// Handle a key press while the selected files are being renamed: edit the
+// pattern or replacement and update the new names, move the cursor, or stop
+// renaming (after renaming the files, if there are no conflicts).
+//
+static void handle_rename_key(bb_t *bb, int key) {
+    rename_t *r = bb->renaming;
+    if (key == KEY_ARROW_UP || key == KEY_ARROW_DOWN) {
+        set_cursor(bb, bb->cursor + (key == KEY_ARROW_UP ? -1 : 1));
+        return;
+    }
+    switch (rename_key(r, key)) {
+    case RENAME_EDITED:
+        rename_update(r, bb);
+        bb->dirty = 1;
+        break;
+    case RENAME_COMMIT: {
+        if (r->error[0] || r->nconflicts > 0) {
+            flash_warn(bb, "Files can't be renamed while there are conflicts");
+            break;
+        }
+        char err[PATH_MAX + 64] = "";
+        int failures = rename_commit(r, bb, rename_entry, err, sizeof(err));
+        if (failures > 0) flash_warn(bb, "%d file(s) could not be renamed: %s", failures, err);
+        stop_renaming(bb);
+        break;
+    }
+    case RENAME_CANCEL: stop_renaming(bb); break;
+    default: break;
+    }
+}
+
+//
+// Handler for SIGWINCH events. The new size is fetched by check_resize() once
+// the resizing has settled down.
+//
+static void handle_winch(int sig) {
+    (void)sig;
+    ++winch_count;
+}
+
 //
 // Initialize the terminal files for /dev/tty and set up some desired
 // attributes like passing Ctrl-c as a key instead of interrupting
 //
 static void init_term(void) {
     nonnegative(tcsetattr(fileno(tty_out), TCSANOW, &bb_termios));
-    update_term_size(0);
+    update_term_size();
     // Initiate mouse tracking and disable text wrapping:
     fputs(T_ENTER_BBMODE, tty_out);
     fflush(tty_out);
@@ -411,56 +1368,124 @@ static int is_simple_bbcmd(const char *s) {
     return 1;
 }
 
+//
+// If an entry is in the current big directory listing (see bigdir.c), load it
+// into the window of listed entries, so that it's selected by ID.
+//
+static void list_entry(bb_t *bb, entry_t *e) {
+    int i;
+    if (bb->bigdir && !IS_LISTED(e) && (i = listed_index(bb, e)) >= 0) (void)bigdir_entry(bb->bigdir, i);
+}
+
+//
+// Return the ID of the i-th file being displayed (see entry_t).
+//
+static int listed_id(bb_t *bb, int i) { return bb->bigdir ? bigdir_id(bb->bigdir, i) : bb->files[i]->id; }
+
+//
+// Return the index of an entry in the current listing, or -1 if it's not listed.
+//
+static int listed_index(bb_t *bb, entry_t *e) {
+    size_t len = strlen(bb->path);
+    if (IS_VIEWED(e) || !bb->bigdir || strncmp(e->fullname, bb->path, len) != 0 || strchr(e->fullname + len, '/'))
+        return e->index;
+    const char *name = e->fullname + len;
+    int i = bigdir_find(bb->bigdir, name, S_ISDIR(e->info.st_mode));
+    return (i < bb->nfiles && streq(bigdir_name(bb->bigdir, i), name)) ? i : -1;
+}
+
+//
+// Make a new entry for a file with the given full path, info and (if it's a
+// symbolic link) link target, and add it to the hash.
+//
+static entry_t *new_entry(bb_t *bb, const char *fullname, const struct stat *info, const char *linkname) {
+    size_t entry_size = sizeof(entry_t) + strlen(fullname) + 1 + (linkname ? strlen(linkname) + 1 : 0);
+    entry_t *entry = new_bytes(entry_size);
+    mem_charge(&entry_pool, entry_size);
+    char *end = stpcpy(entry->fullname, fullname);
+    if (linkname) entry->linkname = strcpy(end + 1, linkname);
+    if (streq(entry->fullname, "/")) {
+        entry->name = entry->fullname;
+    } else {
+        if (strncmp(entry->fullname, bb->path, strlen(bb->path)) == 0) entry->name = entry->fullname + strlen(bb->path);
+        else entry->name = strrchr(entry->fullname, '/') + 1; // Last path component
+    }
+    entry->info = *info;
+    LL_PREPEND(bb->hash[(int)info->st_ino & HASH_MASK], entry, hash);
+    entry->index = -1;
+    return entry;
+}
+
 //
 // Load a file's info into an entry_t and return it (if found).
 // The returned entry must be free()ed by the caller.
 // Warning: this does not deduplicate entries, and it's best if there aren't
 // duplicate entries hanging around.
+// The targets of symbolic links are not stat()ed here, see entry_linkedmode().
+//
+static entry_t *load_entry(bb_t *bb, const char *path) { return load_entry_at(bb, AT_FDCWD, path); }
+
+//
+// Load an entry like load_entry(), but if `dirfd` is not AT_FDCWD, look up the
+// file by its name in the directory `dirfd` (which must be the directory the
+// file is in), which saves resolving the whole path for each file when
+// loading many files from the same directory.
 //
-static entry_t *load_entry(bb_t *bb, const char *path) {
-    struct stat linkedstat, filestat;
+static entry_t *load_entry_at(bb_t *bb, int dirfd, const char *path) {
+    struct stat filestat;
     if (!path || !path[0]) return NULL;
-    if (lstat(path, &filestat) == -1) return NULL;
+    const char *statpath = path;
+    if (dirfd != AT_FDCWD && strrchr(path, '/') && strrchr(path, '/')[1]) statpath = strrchr(path, '/') + 1;
+    else dirfd = AT_FDCWD;
+    if (fstatat(dirfd, statpath, &filestat, AT_SYMLINK_NOFOLLOW) == -1) return NULL;
     char pbuf[PATH_MAX];
     if (path[0] == '/') strcpy(pbuf, path);
     else sprintf(pbuf, "%s%s", bb->path, path);
     if (pbuf[strlen(pbuf) - 1] == '/' && pbuf[1]) pbuf[strlen(pbuf) - 1] = '\0';
 
     // Check for pre-existing:
-    for (entry_t *e = bb->hash[(int)filestat.st_ino & HASH_MASK]; e; e = e->hash.next) {
+    entry_t *e;
+    for (e = bb->hash[(int)filestat.st_ino & HASH_MASK]; e; e = e->hash.next) {
         if (e->info.st_ino == filestat.st_ino
             && e->info.st_dev == filestat.st_dev
             // Need to check filename in case of hard links
             && streq(pbuf, e->fullname))
-            return e;
+            break;
     }
 
-    ssize_t linkpathlen = -1;
-    char linkbuf[PATH_MAX];
-    if (S_ISLNK(filestat.st_mode)) {
-        linkpathlen = nonnegative(readlink(pbuf, linkbuf, sizeof(linkbuf)), "Couldn't read link: '%s'", pbuf);
-        linkbuf[linkpathlen] = '\0';
-        while (linkpathlen > 0 && linkbuf[linkpathlen - 1] == '/')
-            linkbuf[--linkpathlen] = '\0';
-        if (stat(pbuf, &linkedstat) == -1) memset(&linkedstat, 0, sizeof(linkedstat));
-    }
-    size_t pathlen = strlen(pbuf);
-    size_t entry_size = sizeof(entry_t) + (pathlen + 1) + (size_t)(linkpathlen + 1);
-    entry_t *entry = new_bytes(entry_size);
-    char *end = stpcpy(entry->fullname, pbuf);
-    if (linkpathlen >= 0) entry->linkname = strcpy(end + 1, linkbuf);
-    if (streq(entry->fullname, "/")) {
-        entry->name = entry->fullname;
-    } else {
-        if (strncmp(entry->fullname, bb->path, strlen(bb->path)) == 0) entry->name = entry->fullname + strlen(bb->path);
-        else entry->name = strrchr(entry->fullname, '/') + 1; // Last path component
+    if (!e) {
+        ssize_t linkpathlen = -1;
+        char linkbuf[PATH_MAX];
+        if (S_ISLNK(filestat.st_mode)) {
+            linkpathlen = nonnegative(readlinkat(dirfd, statpath, linkbuf, sizeof(linkbuf)),
+                                      "Couldn't read link: '%s'", pbuf);
+            linkbuf[linkpathlen] = '\0';
+            while (linkpathlen > 0 && linkbuf[linkpathlen - 1] == '/')
+                linkbuf[--linkpathlen] = '\0';
+        }
+        e = new_entry(bb, pbuf, &filestat, linkpathlen >= 0 ? linkbuf : NULL);
     }
-    if (S_ISLNK(filestat.st_mode)) entry->linkedmode = linkedstat.st_mode;
-    entry->info = filestat;
-    LL_PREPEND(bb->hash[(int)filestat.st_ino & HASH_MASK], entry, hash);
-    entry->index = -1;
-    bb->hash[(int)filestat.st_ino & HASH_MASK] = entry;
-    return entry;
+    // A file that was selected by path is selected by its entry from now on:
+    if (take_selected_path(bb, pbuf)) set_selected(bb, e, 1);
+    return e;
+}
+
+//
+// Load the entry for a file in a big directory listing (see bigdir.c). Files
+// that were removed after the directory was read get a placeholder entry.
+//
+static entry_t *load_listed_entry(const char *name) {
+    bb_t *bb = current_bb;
+    entry_t *e = load_entry(bb, name);
+    if (e) return e;
+    size_t size = sizeof(entry_t) + strlen(bb->path) + strlen(name) + 1;
+    e = new_bytes(size);
+    mem_charge(&entry_pool, size);
+    e->name = stpcpy(e->fullname, bb->path);
+    strcpy(e->name, name);
+    e->index = -1;
+    LL_PREPEND(bb->hash[0], e, hash);
+    return e;
 }
 
 //
@@ -474,6 +1499,19 @@ static int matches_cmd(const char *str, const char *cmd) {
     return *str == '\0' || *str == ':';
 }
 
+//
+// Return whether a filename matches any of the given (space-separated) globs.
+//
+static int matches_globs(const char *globs, const char *name) {
+    for (const char *pat = globs, *end; *pat; pat = end + (*end ? 1 : 0)) {
+        end = strchrnul(pat, ' ');
+        char buf[PATH_MAX];
+        snprintf(buf, sizeof(buf), "%.*s", (int)(end - pat), pat);
+        if (buf[0] && fnmatch(buf, name, FNM_PERIOD) == 0) return 1;
+    }
+    return 0;
+}
+
 //
 // Prepend `./` to relative paths, replace "~" with $HOME.
 // The normalized path is stored in `normalized`.
@@ -501,6 +1539,7 @@ static char *normalize_path(const char *path, char *normalized) {
 // non-NULL, update `bb` with a listing of the files in `path`
 //
 static int populate_files(bb_t *bb, const char *path) {
+    ALLOC_PHASE(ALLOC_POPULATE);
     int clear_future_history = 0;
     if (path == NULL)
         ;
@@ -514,11 +1553,13 @@ static int populate_files(bb_t *bb, const char *path) {
         path = bb->history->path;
     } else clear_future_history = 1;
 
-    int samedir = path && streq(bb->path, path);
+    int samedir = path && streq(bb->path, path) && !bb->viewing_selection;
+    // Refreshing the listing only changes the rows that changed (see render()):
+    int was_dirty = bb->dirty;
     int old_scroll = bb->scroll;
     int old_cursor = bb->cursor;
     char old_selected[PATH_MAX] = "";
-    if (samedir && bb->nfiles > 0) strcpy(old_selected, bb->files[bb->cursor]->fullname);
+    if (samedir && bb->nfiles > 0) strcpy(old_selected, FILE_AT(bb, bb->cursor)->fullname);
 
     char pbuf[PATH_MAX] = {0}, prev[PATH_MAX] = {0};
     strcpy(prev, bb->path);
@@ -531,7 +1572,7 @@ static int populate_files(bb_t *bb, const char *path) {
         }
     }
 
-    if (clear_future_history && !samedir) {
+    if (clear_future_history && !samedir && !(bb->history && streq(bb->history->path, pbuf))) {
         for (bb_history_t *next, *h = bb->history ? bb->history->next : NULL; h; h = next) {
             next = h->next;
             delete (&h);
@@ -544,54 +1585,74 @@ static int populate_files(bb_t *bb, const char *path) {
         bb->history = h;
     }
 
+    flush_selection(bb);
+    clear_listing(bb);
     bb->dirty = 1;
     strcpy(bb->path, pbuf);
     set_title(bb);
 
-    // Clear old files (if any)
-    if (bb->files) {
-        for (int i = 0; i < bb->nfiles; i++) {
-            bb->files[i]->index = -1;
-            try_free_entry(bb->files[i]);
-            bb->files[i] = NULL;
-        }
-        delete (&bb->files);
-    }
-    bb->nfiles = 0;
-    bb->cursor = 0;
-    bb->scroll = 0;
-
     if (!bb->path[0]) return 0;
 
-    size_t space = 0;
-    glob_t globbuf = {0};
-    char *pat, *tmpglob = check_strdup(bb->globpats);
-    while ((pat = strsep(&tmpglob, " ")) != NULL)
-        glob(pat, GLOB_NOSORT | GLOB_APPEND, NULL, &globbuf);
-    delete (&tmpglob);
-    for (size_t i = 0; i < globbuf.gl_pathc; i++) {
-        // Don't normalize path so we can get "." and ".."
-        entry_t *entry = load_entry(bb, globbuf.gl_pathv[i]);
-        if (!entry) {
-            flash_warn(bb, "Failed to load entry: '%s'", globbuf.gl_pathv[i]);
-            continue;
+    // When none of the globs have a slash, all of the files in the directory
+    // are loaded, and the globs are applied as a filter. That way, changing
+    // the globs later (e.g. toggling dotfiles) doesn't require reloading.
+    bb->loaded_all = !strchr(bb->globpats, '/');
+
+    links_new_generation();
+    xattrs_new_generation();
+    clear_sort_orders();
+    // If there isn't enough memory to load every file, only the names are
+    // loaded, and entries are loaded as they're needed:
+    if (resumed && !streq(resumed->strings + resumed->header->path, bb->path)) resumed = NULL;
+    char *records = NULL; // The directory's files, if it was read but isn't too big
+    int nrecords = 0;
+    if (bb->loaded_all && !resumed)
+        bb->bigdir = bigdir_open(bb->path, mem_available(), load_listed_entry, try_free_entry, &records, &nrecords);
+    if (bb->bigdir) {
+        bitset_resize(&bb->selection, bb->bigdir->count);
+        if (bb->bigdir->truncated)
+            flash_warn(bb, "Only the first %d files in this directory are listed", bb->bigdir->count);
+    } else if (resumed) {
+        resume_listing(bb);
+    } else {
+        size_t space = 0;
+        glob_t globbuf = {0};
+        if (!records) {
+            char *pat, *globs = check_strdup(bb->loaded_all ? ".* *" : bb->globpats);
+            for (char *tmpglob = globs; (pat = strsep(&tmpglob, " ")) != NULL;)
+                glob(pat, GLOB_NOSORT | GLOB_APPEND, NULL, &globbuf);
+            delete (&globs);
         }
-        entry->index = bb->nfiles;
-        if ((size_t)bb->nfiles + 1 > space) bb->files = grow(bb->files, space += 100);
-        bb->files[bb->nfiles++] = entry;
-    }
-    globfree(&globbuf);
-
-    // RNG is seeded with a hash of all the inodes in the current dir
-    // This hash algorithm is based on Python's frozenset hashing
-    unsigned long seed = (unsigned long)bb->nfiles * 1927868237UL;
-    for (int i = 0; i < bb->nfiles; i++)
-        seed ^= ((bb->files[i]->info.st_ino ^ 89869747UL) ^ (bb->files[i]->info.st_ino << 16)) * 3644798167UL;
-    srand((unsigned int)seed);
-    for (int i = 0; i < bb->nfiles; i++) {
-        int j = rand() % (i + 1); // This introduces some RNG bias, but it's not important here
-        bb->files[i]->shufflepos = bb->files[j]->shufflepos;
-        bb->files[j]->shufflepos = i;
+        size_t npaths = records ? (size_t)nrecords : globbuf.gl_pathc;
+        const char *record = records;
+        int vanished = 0;
+        for (size_t i = 0; i < npaths; i++) {
+            const char *path = records ? record + 1 : globbuf.gl_pathv[i];
+            if (records) record += strlen(record) + 1;
+            // Don't normalize path so we can get "." and ".."
+            entry_t *entry = load_entry(bb, path);
+            if (!entry) { // Removed after globbing
+                ++vanished;
+                continue;
+            }
+            if (IS_LISTED(entry)) continue; // Matched by more than one glob
+            entry->listed = 1;
+            entry->id = bb->nloaded;
+            if ((size_t)bb->nloaded + 1 > space) bb->loaded = grow(bb->loaded, space = MAX(100, 2 * space));
+            bb->loaded[bb->nloaded++] = entry;
+        }
+        if (records) delete (&records);
+        else globfree(&globbuf);
+        shuffle_files(bb);
+        bitset_resize(&bb->selection, bb->nloaded);
+        for (int i = 0; i < bb->nloaded; i++) {
+            if (!bb->loaded[i]->selected.atme) continue;
+            // Selected before it was listed:
+            LL_REMOVE(bb->loaded[i], selected);
+            --bb->nselected;
+            bitset_set(&bb->selection, i, 1);
+        }
+        if (vanished) flash_warn(bb, "%d file%s vanished during load", vanished, vanished == 1 ? "" : "s");
     }
 
     sort_files(bb);
@@ -600,13 +1661,19 @@ static int populate_files(bb_t *bb, const char *path) {
         bb->cursor = old_cursor > bb->nfiles - 1 ? bb->nfiles - 1 : old_cursor;
         if (old_selected[0]) {
             entry_t *e = load_entry(bb, old_selected);
-            if (e) set_cursor(bb, e->index);
+            if (e) {
+                set_cursor(bb, listed_index(bb, e));
+                try_free_entry(e);
+            }
         }
+        bb->dirty = was_dirty;
+        bb->listing_changed = 1;
     } else {
         entry_t *p = load_entry(bb, prev);
         if (p) {
-            if (IS_VIEWED(p)) set_cursor(bb, p->index);
-            else try_free_entry(p);
+            int i = listed_index(bb, p);
+            if (i >= 0) set_cursor(bb, i);
+            try_free_entry(p);
         }
     }
     return 0;
@@ -639,78 +1706,150 @@ static void print_bindings(FILE *f) {
     fprintf(f, "\n");
 }
 
+//
+// Print the groups of files in the listing that are hard links to the same
+// file, and the total size of the listing, counting each file once no matter
+// how many links to it are listed. The files are grouped in one pass over the
+// listing, with a hash table of groups by device and inode.
+//
+static void print_link_groups(bb_t *bb, FILE *f) {
+    // Directories can't be hard linked, so their link counts are just their subdirectories:
+#define MAY_BE_LINKED(e) ((e)->info.st_nlink >= 2 && !S_ISDIR((e)->info.st_mode))
+    struct {
+        dev_t dev;
+        ino_t ino;
+        int first, last, count; // The group's first and last files (by index), and how many there are
+    } *groups;
+    size_t nlinked = 0, nslots = 16;
+    for (int i = 0; i < bb->nfiles; i++)
+        if (MAY_BE_LINKED(bb->files[i])) ++nlinked;
+    while (nslots < 2 * nlinked)
+        nslots *= 2;
+    groups = new_bytes(nslots * sizeof(groups[0]));
+    // For each file: the slot of its group (or -1), and the next file in the group (or -1)
+    int *slot = new (int[(size_t)MAX(bb->nfiles, 1)]), *next = new (int[(size_t)MAX(bb->nfiles, 1)]);
+    off_t size = 0, linked_size = 0;
+    int ninodes = 0, ngroups = 0;
+    for (int i = 0; i < bb->nfiles; i++) {
+        entry_t *e = bb->files[i];
+        linked_size += e->info.st_size;
+        slot[i] = next[i] = -1;
+        if (MAY_BE_LINKED(e)) {
+            size_t h = (hash_bytes(&e->info.st_ino, sizeof(e->info.st_ino)) ^ (size_t)e->info.st_dev) & (nslots - 1);
+            while (groups[h].count > 0 && (groups[h].ino != e->info.st_ino || groups[h].dev != e->info.st_dev))
+                h = (h + 1) & (nslots - 1);
+            slot[i] = (int)h;
+            if (groups[h].count++ > 0) { // The first file listed stands for the group
+                next[groups[h].last] = i;
+                groups[h].last = i;
+                continue;
+            }
+            groups[h].dev = e->info.st_dev;
+            groups[h].ino = e->info.st_ino;
+            groups[h].first = groups[h].last = i;
+        }
+        size += e->info.st_size;
+        ++ninodes;
+    }
+    for (int i = 0; i < bb->nfiles; i++) {
+        if (slot[i] < 0 || groups[slot[i]].first != i || groups[slot[i]].count < 2) continue;
+        entry_t *e = bb->files[i];
+        if (ngroups++ == 0) fprintf(f, "\033[1;4mHard links\033[0m\n");
+        fprintf(f, "\033[1minode %llu\033[0m (%lu links, %d listed, %lld bytes)\n", (unsigned long long)e->info.st_ino,
+                (unsigned long)e->info.st_nlink, groups[slot[i]].count, (long long)e->info.st_size);
+        for (int j = i; j >= 0; j = next[j])
+            fprintf(f, "    %s\n", bb->files[j]->name);
+    }
+#undef MAY_BE_LINKED
+    delete (&groups);
+    delete (&slot);
+    delete (&next);
+    if (ngroups == 0) fprintf(f, "No files in the listing are hard links to each other\n");
+    fprintf(f, "\n%d file%s (%d distinct): %lld bytes, or %lld bytes counting every link\n", bb->nfiles,
+            bb->nfiles == 1 ? "" : "s", ninodes, (long long)size, (long long)linked_size);
+}
+
+//
+// Print the captured output of the given stream ("stdout" or "stderr"), or
+// both if `name` is NULL or empty.
+//
+static void print_output(FILE *f, const char *name) {
+    FOREACH(outbuf_t *, ob, output_buffers) {
+        if (ob->tmp_fd == -1 || (name && name[0] && !streq(name, ob->name))) continue;
+        fprintf(f, "\033[1;4m%s\033[0m\n", ob->name);
+        if (ob->dropped > 0) fprintf(f, "\033[2m[...%lld earlier bytes dropped...]\033[0m\n", (long long)ob->dropped);
+        fflush(f);
+        copy_bytes(fileno(f), ob->tmp_fd, 0, ob->size);
+        fprintf(f, "\n");
+    }
+}
+
+//
+// Free remembered sort orders, least recently used first.
+//
+static size_t reclaim_sort_orders(size_t want) {
+    size_t freed = 0;
+    while (freed < want) {
+        int lru = -1;
+        for (int i = 0; i < SORT_CACHE_SIZE; i++)
+            if (sort_orders[i].order && (lru == -1 || sort_orders[i].lastused < sort_orders[lru].lastused)) lru = i;
+        if (lru == -1) break;
+        delete (&sort_orders[lru].order);
+        freed += (size_t)current_bb->nloaded * sizeof(entry_t *);
+    }
+    mem_release(&sort_pool, freed);
+    return freed;
+}
+
 //
 // Run a bb internal command (e.g. "+refresh") and return an indicator of what
 // needs to happen next.
 //
 static void run_bbcmd(bb_t *bb, const char *cmd) {
+    ALLOC_PHASE(ALLOC_COMMAND);
     while (*cmd == ' ' || *cmd == '\n')
         ++cmd;
     if (strncmp(cmd, "bbcmd ", strlen("bbcmd ")) == 0) cmd = &cmd[strlen("bbcmd ")];
     const char *value = strchr(cmd, ':');
     if (value) ++value;
-    if (matches_cmd(cmd, "bind:")) { // +bind:<keys>:<script>
-        char *value_copy = check_strdup(value);
-        char *keys = trim(value_copy);
-        if (!keys[0]) {
-            delete (&value_copy);
+    if (matches_cmd(cmd, "allocations:") || matches_cmd(cmd, "allocations")) { // +allocations:
+#ifdef BB_ALLOC_STATS
+        FILE *f = value ? fopen(value, "a") : popen("less -rfKX >/dev/tty", "w");
+        if (!f) {
+            flash_warn(bb, "Could not open file for allocation report: \"%s\"", value);
             return;
         }
-        char *script = strchr(keys + 1, ':');
-        if (!script) {
-            delete (&value_copy);
-            flash_warn(bb, "No script provided.");
-            return;
-        }
-        *script = '\0';
-        script = trim(script + 1);
-        char *description;
-        if (script[0] == '#') {
-            description = trim(strsep(&script, "\n") + 1);
-            if (!script) script = (char *)"";
-            else script = trim(script);
-        } else description = script;
-        for (char *key; (key = strsep(&keys, ","));) {
-            int keyval;
-            if (streq(key, "Section")) {
-                keyval = -1;
-            } else {
-                keyval = bkeywithname(key);
-                if (keyval == -1) continue;
-                // Delete existing bindings for this key (if any):
-                FOREACH(binding_t *, b, bindings) {
-                    if (b->key == keyval) {
-                        delete ((char **)&b->description);
-                        delete ((char **)&b->script);
-                        int i = (int)(b - bindings);
-                        memmove(&bindings[i], &bindings[i + 1], sizeof(binding_t) * (LEN(bindings) - i - 1));
-                        memset(&bindings[LEN(bindings) - 1], 0, sizeof(binding_t));
-                    }
-                }
-            }
-            // Append binding:
-            FOREACH(binding_t *, b, bindings) {
-                if (b->script) continue;
-                b->key = keyval;
-                if (is_simple_bbcmd(script)) b->script = check_strdup(script);
-                else nonnegative(asprintf((char **)&b->script, "set -e\n%s", script), "Could not copy script");
-                b->description = check_strdup(description);
-                break;
-            }
+        alloc_print_report(f);
+        if (value) fclose(f);
+        else pclose(f);
+        bb->dirty = 1;
+#else
+        flash_warn(bb, "Allocations are only counted when " BB_NAME " is built with BB_ALLOC_STATS");
+#endif
+    } else if (matches_cmd(cmd, "bind:")) { // +bind:<keys>:<script>
+        if (bbkeys.recording) {
+            bbkeys.defs = grow(bbkeys.defs, bbkeys.ndefs + 2);
+            bbkeys.defs[bbkeys.ndefs++] = check_strdup(value);
+            bbkeys.defs[bbkeys.ndefs] = NULL;
         }
-        delete (&value_copy);
+        if (!bbkeys.reloading) add_bindings(bb, bindings, value, 0);
     } else if (matches_cmd(cmd, "cd:")) { // +cd:
+        latency_refine(LATENCY_CD);
         if (populate_files(bb, value)) flash_warn(bb, "Could not open directory: \"%s\"", value);
     } else if (matches_cmd(cmd, "columns:")) { // +columns:
         set_columns(bb, value);
     } else if (matches_cmd(cmd, "deselect")) { // +deselect
+        bitset_set_range(&bb->selection, 0, bb->selection.nbits, 0);
+        bb->dirty = 1;
         while (bb->selected)
             set_selected(bb, bb->selected, 0);
+        clear_selected_paths(bb);
     } else if (matches_cmd(cmd, "deselect:")) { // +deselect:<file>
         char pbuf[PATH_MAX];
         normalize_path(value, pbuf);
         entry_t *e = load_entry(bb, pbuf);
         if (e) {
+            list_entry(bb, e);
             set_selected(bb, e, 0);
             return;
         }
@@ -721,6 +1860,11 @@ static void run_bbcmd(bb_t *bb, const char *cmd) {
                 return;
             }
         }
+        if (take_selected_path(bb, pbuf)) bb->dirty = 1;
+    } else if (matches_cmd(cmd, "deselect-glob:")) { // +deselect-glob:<patterns>
+        select_matching(bb, value, 0);
+    } else if (matches_cmd(cmd, "deselect-saved:")) { // +deselect-saved:<file>
+        combine_selection(bb, value, '-');
     } else if (matches_cmd(cmd, "fg:") || matches_cmd(cmd, "fg")) { // +fg:
         int nprocs = 0;
         for (proc_t *p = bb->running_procs; p; p = p->running.next)
@@ -744,15 +1888,49 @@ static void run_bbcmd(bb_t *bb, const char *cmd) {
         bb->dirty = 1;
     } else if (matches_cmd(cmd, "glob:")) { // +glob:
         set_globs(bb, value[0] ? value : "*");
-        populate_files(bb, bb->path);
+        // Only reload if the new globs can match files that weren't loaded:
+        if (!bb->loaded_all || strchr(bb->globpats, '/')) {
+            populate_files(bb, bb->path);
+            return;
+        }
+        int row = bb->cursor - bb->scroll;
+        // Keep the cursor on the same file, or the next one that's still shown:
+        int newcur = 0;
+        if (bb->bigdir) {
+            newcur = bigdir_filter(bb->bigdir, matches_globs, bb->globpats, bb->cursor);
+            bb->nfiles = bb->bigdir->nshown;
+            adopt_selection(bb);
+        } else {
+            entry_t *oldcur = bb->nfiles > 0 ? bb->files[bb->cursor] : NULL;
+            filter_files(bb);
+            for (int i = 0; i < bb->nloaded && bb->loaded[i] != oldcur; i++)
+                if (IS_VIEWED(bb->loaded[i])) ++newcur;
+        }
+        bb->cursor = MIN(newcur, bb->nfiles - 1);
+        bb->scroll = bb->cursor - row;
+        set_scroll(bb, bb->scroll);
+        set_cursor(bb, bb->cursor);
     } else if (matches_cmd(cmd, "goto:") || matches_cmd(cmd, "goto")) { // +goto:
-        if (!value && !bb->selected) return;
+        char pbuf[PATH_MAX];
+        if (!value && !bb->selected) {
+            // Go to the first selected file in the current listing:
+            int id = bitset_next(&bb->selection, 0);
+            if (id < 0 && bb->nselected_paths == 0) return;
+            if (id < 0) {
+                strcpy(pbuf, bb->selected_paths[0]);
+            } else if (bb->bigdir) {
+                sprintf(pbuf, "%s%s", bb->path, bigdir_id_name(bb->bigdir, id));
+            } else {
+                for (int i = 0; i < bb->nloaded; i++)
+                    if (bb->loaded[i]->id == id) strcpy(pbuf, bb->loaded[i]->fullname);
+            }
+            value = pbuf;
+        }
         entry_t *e = load_entry(bb, value ? value : bb->selected->fullname);
         if (!e) {
             flash_warn(bb, "Could not find file to go to: \"%s\"", value);
             return;
         }
-        char pbuf[PATH_MAX];
         strcpy(pbuf, e->fullname);
         char *lastslash = strrchr(pbuf, '/');
         if (!lastslash) errx(EXIT_FAILURE, "No slash found in filename: %s", pbuf);
@@ -764,17 +1942,55 @@ static void run_bbcmd(bb_t *bb, const char *cmd) {
         if (!e) {
             flash_warn(bb, "Could not find file again: \"%s\"", lastslash + 1);
         }
-        if (IS_VIEWED(e)) set_cursor(bb, e->index);
-        else try_free_entry(e);
+        int i = e ? listed_index(bb, e) : -1;
+        if (i >= 0) set_cursor(bb, i);
+        if (e) try_free_entry(e);
     } else if (matches_cmd(cmd, "help")) { // +help
         FILE *p = popen("less -rfKX >/dev/tty", "w");
         print_bindings(p);
         pclose(p);
         bb->dirty = 1;
+    } else if (matches_cmd(cmd, "intersect-saved:")) { // +intersect-saved:<file>
+        combine_selection(bb, value, '&');
     } else if (matches_cmd(cmd, "interleave:") || matches_cmd(cmd, "interleave")) { // +interleave
         bb->interleave_dirs = value ? (value[0] == '1') : !bb->interleave_dirs;
         set_interleave(bb, bb->interleave_dirs);
         sort_files(bb);
+    } else if (matches_cmd(cmd, "latency:") || matches_cmd(cmd, "latency")) { // +latency:
+        FILE *f = value ? fopen(value, "a") : popen("less -rfKX >/dev/tty", "w");
+        if (!f) {
+            flash_warn(bb, "Could not open file for latency report: \"%s\"", value);
+            return;
+        }
+        latency_print_report(f);
+        if (value) fclose(f);
+        else pclose(f);
+        bb->dirty = 1;
+    } else if (matches_cmd(cmd, "linkgroups:") || matches_cmd(cmd, "linkgroups")) { // +linkgroups:
+        if (bb->bigdir) {
+            flash_warn(bb, "Link groups aren't supported in directories this big");
+            return;
+        }
+        FILE *f = value ? fopen(value, "a") : popen("less -rfKX >/dev/tty", "w");
+        if (!f) {
+            flash_warn(bb, "Could not open file for link groups: \"%s\"", value);
+            return;
+        }
+        print_link_groups(bb, f);
+        if (value) fclose(f);
+        else pclose(f);
+        bb->dirty = 1;
+    } else if (matches_cmd(cmd, "memory:") || matches_cmd(cmd, "memory")) { // +memory:
+        if (value) {
+            size_t budget = mem_parse_size(value);
+            if (budget) mem_set_budget(budget);
+            else flash_warn(bb, "Invalid memory budget: \"%s\"", value);
+            return;
+        }
+        FILE *p = popen("less -rfKX >/dev/tty", "w");
+        mem_print_report(p);
+        pclose(p);
+        bb->dirty = 1;
     } else if (matches_cmd(cmd, "move:")) { // +move:
         int oldcur, isdelta, n;
     move:
@@ -786,14 +2002,25 @@ static void run_bbcmd(bb_t *bb, const char *cmd) {
         if (isdelta) set_cursor(bb, bb->cursor + n);
         else set_cursor(bb, n);
         if (matches_cmd(cmd, "spread:")) { // +spread:
-            int sel = IS_SELECTED(bb->files[oldcur]);
-            for (int i = bb->cursor; i != oldcur; i += (oldcur > i ? 1 : -1))
-                set_selected(bb, bb->files[i], sel);
+            int sel = IS_SELECTED(bb, FILE_AT(bb, oldcur));
+            select_listed(bb, MIN(bb->cursor, oldcur), MAX(bb->cursor, oldcur) + 1, sel);
         }
+    } else if (matches_cmd(cmd, "output:") || matches_cmd(cmd, "output")) { // +output:
+        trim_output_buffers();
+        FILE *p = popen("less -rfKX >/dev/tty", "w");
+        print_output(p, value);
+        pclose(p);
+        bb->dirty = 1;
     } else if (matches_cmd(cmd, "quit")) { // +quit
         bb->should_quit = 1;
     } else if (matches_cmd(cmd, "refresh")) { // +refresh
-        populate_files(bb, bb->path);
+        links_forget();
+        if (bb->viewing_selection) view_selection(bb);
+        else populate_files(bb, bb->path);
+    } else if (matches_cmd(cmd, "rename")) { // +rename
+        start_renaming(bb);
+    } else if (matches_cmd(cmd, "save-selection:")) { // +save-selection:<file>
+        save_selection(bb, value);
     } else if (matches_cmd(cmd, "scroll:")) { // +scroll:
         // TODO: figure out the best version of this
         int isdelta = value[0] == '+' || value[0] == '-';
@@ -802,29 +2029,245 @@ static void run_bbcmd(bb_t *bb, const char *cmd) {
         if (isdelta) set_scroll(bb, bb->scroll + n);
         else set_scroll(bb, n);
     } else if (matches_cmd(cmd, "select")) { // +select
-        for (int i = 0; i < bb->nfiles; i++)
-            set_selected(bb, bb->files[i], 1);
+        select_listed(bb, 0, bb->nfiles, 1);
     } else if (matches_cmd(cmd, "select:")) { // +select:<file>
         entry_t *e = load_entry(bb, value);
+        if (e) list_entry(bb, e);
         if (e) set_selected(bb, e, 1);
         else flash_warn(bb, "Could not find file to select: \"%s\"", value);
+    } else if (matches_cmd(cmd, "select-glob:")) { // +select-glob:<patterns>
+        select_matching(bb, value, 1);
+    } else if (matches_cmd(cmd, "select-saved:")) { // +select-saved:<file>
+        combine_selection(bb, value, '+');
+    } else if (matches_cmd(cmd, "selection:") || matches_cmd(cmd, "selection")) { // +selection:
+        // Viewing the selection again (e.g. after it changed) shows it as it is now:
+        if (value ? value[0] == '1' : !bb->viewing_selection) view_selection(bb);
+        else if (bb->viewing_selection) populate_files(bb, bb->path);
     } else if (matches_cmd(cmd, "sort:")) { // +sort:
+        latency_refine(LATENCY_SORT);
         set_sort(bb, value);
+        if (bb->bigdir && bb->sort[1] != COL_NAME)
+            flash_warn(bb, "Only sorting by name is supported in directories this big");
         sort_files(bb);
     } else if (matches_cmd(cmd, "spread:")) { // +spread:
         goto move;
     } else if (matches_cmd(cmd, "toggle")) { // +toggle
-        for (int i = 0; i < bb->nfiles; i++)
-            set_selected(bb, bb->files[i], !IS_SELECTED(bb->files[i]));
+        if (bb->nfiles == bb->selection.nbits) {
+            bitset_invert_range(&bb->selection, 0, bb->nfiles);
+        } else {
+            for (int i = 0; i < bb->nfiles; i++) {
+                int id = listed_id(bb, i);
+                bitset_set(&bb->selection, id, !BITSET_GET(&bb->selection, id));
+            }
+        }
+        bb->dirty = 1;
     } else if (matches_cmd(cmd, "toggle:")) { // +toggle:<file>
         entry_t *e = load_entry(bb, value);
-        if (e) set_selected(bb, e, !IS_SELECTED(e));
+        if (e) list_entry(bb, e);
+        if (e) set_selected(bb, e, !IS_SELECTED(bb, e));
         else flash_warn(bb, "Could not find file to toggle: \"%s\"", value);
     } else {
         flash_warn(bb, "Invalid bb command: %s", cmd);
     }
 }
 
+//
+// Read a saved selection (see save_selection()) into a sorted list of paths,
+// and store how many there are in `count`. Selections saved by older versions
+// of bb, as a directory of symbolic links, can also be read. Return NULL if
+// the selection can't be read.
+//
+static char **read_saved_selection(const char *path, int *count) {
+    char **paths = NULL;
+    size_t n = 0, space = 0;
+    DIR *dir = opendir(path);
+    if (dir) {
+        for (struct dirent *dp; (dp = readdir(dir));) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd(dir), dp->d_name, target, sizeof(target) - 1);
+            if (len <= 0) continue;
+            target[len] = '\0';
+            if (n + 1 > space) paths = grow(paths, space = MAX(100, 2 * space));
+            paths[n++] = check_strdup(target);
+        }
+        closedir(dir);
+    } else {
+        FILE *f = fopen(path, "r");
+        if (!f) return NULL;
+        char *line = NULL;
+        size_t linespace = 0;
+        for (ssize_t len; (len = getdelim(&line, &linespace, '\0', f)) > 0;) {
+            if (line[0] != '/') continue;
+            if (n + 1 > space) paths = grow(paths, space = MAX(100, 2 * space));
+            paths[n++] = check_strdup(line);
+        }
+        delete (&line);
+        fclose(f);
+    }
+    if (!paths) paths = new (char *);
+    // Files should already be sorted, but they might have been edited by hand:
+    size_t unique = 0;
+    for (size_t i = 1; i < n; i++) {
+        if (compare_paths(paths[i - 1], paths[i]) >= 0) {
+            qsort(paths, n, sizeof(char *), compare_saved_paths);
+            break;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (unique > 0 && streq(paths[unique - 1], paths[i])) delete (&paths[i]);
+        else paths[unique++] = paths[i];
+    }
+    *count = (int)unique;
+    return paths;
+}
+
+//
+// Remove the bindings for a key binding definition ("<keys>:<script>") from a
+// binding table, except for keys bound by any of the `rebound` definitions
+// (if not NULL), which add_bindings() can replace in place.
+//
+static void remove_bindings(binding_t *table, const char *def, char **rebound) {
+    char *def_copy = check_strdup(def);
+    char *keys, *script, *description;
+    if (split_binding(def_copy, &keys, &script, &description)) {
+        for (char *key; (key = strsep(&keys, ","));) {
+            int section = streq(key, "Section");
+            int keyval = section ? -1 : bkeywithname(key);
+            if (keyval == -1 && !section) continue;
+            int is_rebound = 0;
+            for (char **d = rebound; !section && d && *d && !is_rebound; d++)
+                is_rebound = binds_key(*d, keyval);
+            if (is_rebound) continue;
+            for (binding_t *b = table; b < &table[MAX_BINDINGS] && b->script;) {
+                if (b->key != keyval || (section && !streq(b->description, description))) {
+                    ++b;
+                    continue;
+                }
+                delete ((char **)&b->description);
+                delete ((char **)&b->script);
+                memmove(b, b + 1, sizeof(binding_t) * (size_t)(&table[MAX_BINDINGS - 1] - b));
+                memset(&table[MAX_BINDINGS - 1], 0, sizeof(binding_t));
+            }
+        }
+    }
+    delete (&def_copy);
+}
+
+//
+// Replace the entry for a file that was renamed with an entry for its new
+// path, and return the new entry (see rename_commit()). The file's info
+// hasn't changed, so it's not read again.
+//
+static entry_t *rename_entry(entry_t *e, const char *path) {
+    size_t size = sizeof(entry_t) + strlen(path) + 1 + (e->linkname ? strlen(e->linkname) + 1 : 0);
+    entry_t *renamed = new_bytes(size);
+    mem_charge(&entry_pool, size);
+    memcpy(renamed, e, sizeof(entry_t));
+    char *end = stpcpy(renamed->fullname, path);
+    if (e->linkname) renamed->linkname = strcpy(end + 1, e->linkname);
+    renamed->name = renamed->fullname + (e->name - e->fullname); // The directory part is the same
+    renamed->color = 0;
+    if (renamed->hash.next) renamed->hash.next->hash.atme = &renamed->hash.next;
+    if (renamed->hash.atme) *renamed->hash.atme = renamed;
+    if (renamed->selected.next) renamed->selected.next->selected.atme = &renamed->selected.next;
+    if (renamed->selected.atme) *renamed->selected.atme = renamed;
+    mem_release(&entry_pool, entry_size(e));
+    delete (&e);
+    return renamed;
+}
+
+//
+// Sort the files again because the results of a background lookup came in,
+// keeping the cursor on the same file and without redrawing everything.
+//
+static void resort_files(bb_t *bb) {
+    entry_t *cursor = bb->nfiles > 0 ? bb->files[bb->cursor] : NULL;
+    int was_dirty = bb->dirty;
+    sort_files(bb);
+    bb->dirty = was_dirty;
+    if (cursor && cursor->index >= 0) set_cursor(bb, cursor->index);
+}
+
+//
+// Load the listing from the session snapshot being resumed, in its sorted
+// order and with its selection, without reading the directory again.
+//
+static void resume_listing(bb_t *bb) {
+    const session_header_t *h = resumed->header;
+    bb->loaded = new (entry_t * [MAX(h->nfiles, 1)]);
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        uint32_t id = resumed->order[i];
+        const session_file_t *f = &resumed->files[id];
+        char fullname[PATH_MAX];
+        snprintf(fullname, sizeof(fullname), "%s%s", bb->path, resumed->strings + f->name);
+        entry_t *e = new_entry(bb, fullname, &f->info,
+                               f->linkname == SESSION_NONE ? NULL : resumed->strings + f->linkname);
+        e->listed = 1;
+        e->id = (int)id;
+        bb->loaded[bb->nloaded++] = e;
+    }
+    shuffle_files(bb);
+    bitset_resize(&bb->selection, bb->nloaded);
+    if (bb->nloaded > 0) bitset_load(&bb->selection, resumed->selection);
+    // The files are already sorted the way they were when the snapshot was made:
+    if (streq(bb->sort, resumed->strings + h->sort) && bb->interleave_dirs == h->interleave_dirs)
+        cache_sort_order(bb);
+}
+
+//
+// Load the initial listing at `path`, resuming bb's session from the snapshot
+// in $BBSESSION (if there is one): its history, selection, and (if it was for
+// the same directory and the directory hasn't changed) its listing, which is
+// then checked against the filesystem while bb is idle (see check_session()).
+//
+static void resume_session(bb_t *bb, const char *path) {
+    const char *file = getenv("BBSESSION");
+    session_t *s = file && file[0] ? session_open(file) : NULL;
+    if (s) {
+        const session_header_t *h = s->header;
+        const char *str = s->strings + h->history;
+        for (uint32_t i = 0; i < h->nhistory; i++, str += strlen(str) + 1) {
+            bb_history_t *hist = new (bb_history_t);
+            snprintf(hist->path, sizeof(hist->path), "%s", str);
+            hist->prev = bb->history;
+            if (bb->history) bb->history->next = hist;
+            bb->history = hist;
+        }
+        for (uint32_t i = h->nhistory; i > h->history_current + 1; i--)
+            bb->history = bb->history->prev;
+
+        char dir[PATH_MAX + 1];
+        struct stat info;
+        snprintf(dir, sizeof(dir), "%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/");
+        if (streq(s->strings + h->path, dir) && stat(dir, &info) == 0 && info.st_dev == h->dir_dev
+            && info.st_ino == h->dir_ino && memcmp(&get_mtime(info), &h->dir_mtime, sizeof(struct timespec)) == 0
+            && h->nfiles > 0) {
+            resumed = s;
+            set_globs(bb, s->strings + h->globpats);
+            set_sort(bb, s->strings + h->sort);
+            set_columns(bb, s->strings + h->columns);
+            set_interleave(bb, h->interleave_dirs);
+        }
+    }
+
+    if (populate_files(bb, path)) errx(EXIT_FAILURE, "Could not find initial path: \"%s\"", path);
+
+    if (resumed) {
+        set_scroll(bb, resumed->header->scroll);
+        set_cursor(bb, resumed->header->cursor);
+        verify_next = 0;
+        resumed = NULL;
+    }
+    if (s) {
+        const char *str = s->strings + s->header->selected;
+        for (uint32_t i = 0; i < s->header->nselected; i++, str += strlen(str) + 1) {
+            entry_t *e = load_entry(bb, str);
+            if (e) set_selected(bb, e, 1);
+        }
+        session_close(s);
+    }
+}
+
 //
 // Close the /dev/tty terminals and restore some of the attributes.
 //
@@ -846,19 +2289,23 @@ static int run_script(bb_t *bb, const char *cmd) {
         pid_t pgrp = getpid();
         (void)setpgid(0, pgrp);
         nonnegative(tcsetpgrp(STDIN_FILENO, pgrp));
-        const char **args = new (char * [4 + (size_t)bb->nselected + 1]);
+        flush_selection(bb);
+        const char **args = new (char * [4 + (size_t)bb->nselected_paths + (size_t)bb->nselected + 1]);
         int i = 0;
         args[i++] = "sh";
         args[i++] = "-c";
         args[i++] = (char *)cmd;
         args[i++] = "--"; // ensure files like "-i" are not interpreted as flags for sh
-        // bb->selected is in most-recent order, so populate args in reverse to make sure
-        // that $1 is the first selected, etc.
+        // The files selected by path come first. bb->selected is in most-recent order,
+        // so populate args in reverse to make sure that $1 is the first selected, etc.
+        // (with the current listing's selected files last, in the order they're listed).
+        for (int j = 0; j < bb->nselected_paths; j++)
+            args[i++] = bb->selected_paths[j];
         i += bb->nselected;
         for (entry_t *e = bb->selected; e; e = e->selected.next)
             args[--i] = e->fullname;
 
-        setenv("BB", bb->nfiles ? bb->files[bb->cursor]->fullname : "", 1);
+        setenv("BB", bb->nfiles ? FILE_AT(bb, bb->cursor)->fullname : "", 1);
 
         dup2(fileno(tty_out), STDOUT_FILENO);
         dup2(fileno(tty_out), STDERR_FILENO);
@@ -875,6 +2322,120 @@ static int run_script(bb_t *bb, const char *cmd) {
     return status;
 }
 
+//
+// Save the selected files to the file at `path`, as a list of full paths
+// sorted by compare_paths() and separated by NUL bytes. The file is written
+// in full before it replaces any existing file.
+//
+static void save_selection(bb_t *bb, const char *path) {
+    int n;
+    selected_file_t *files = get_selected_files(bb, &n);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f) {
+        for (int i = 0; i < n; i++)
+            fwrite(files[i].path, 1, strlen(files[i].path) + 1, f);
+    }
+    if (!f || ferror(f) | fclose(f) || rename(tmp, path) != 0) {
+        flash_warn(bb, "Could not save selection: \"%s\"", path);
+        if (fd >= 0) unlink(tmp);
+    }
+    for (int i = 0; i < n; i++)
+        if (!files[i].entry) delete (&files[i].path);
+    delete (&files);
+}
+
+//
+// Save a snapshot of bb's session to the file in $BBSESSION (if it's set), so
+// it can be resumed the next time bb starts (see resume_session()). The
+// listing is only saved if it's a normal directory listing.
+//
+static void save_session(bb_t *bb) {
+    const char *file = getenv("BBSESSION");
+    if (!file || !file[0] || !bb->path[0]) return;
+    session_changed = 0;
+    int with_listing = !bb->bigdir && !bb->viewing_selection && bb->selection.nbits == bb->nloaded;
+    int n = 0;
+    char **paths;
+    selected_file_t *files = NULL;
+    if (with_listing) { // The listed files' selection is saved with the listing
+        paths = new (char * [(size_t)MAX(bb->nselected + bb->nselected_paths, 1)]);
+        for (entry_t *e = bb->selected; e; e = e->selected.next)
+            paths[n++] = e->fullname;
+        for (int i = 0; i < bb->nselected_paths; i++)
+            paths[n++] = bb->selected_paths[i];
+    } else {
+        files = get_selected_files(bb, &n);
+        paths = new (char * [(size_t)MAX(n, 1)]);
+        for (int i = 0; i < n; i++)
+            paths[i] = files[i].path;
+    }
+    if (session_write(file, bb, with_listing, paths, n) != 0) flash_warn(bb, "Could not save session: \"%s\"", file);
+    for (int i = 0; files && i < n; i++)
+        if (!files[i].entry) delete (&files[i].path);
+    delete (&files);
+    delete (&paths);
+}
+
+//
+// Select or deselect the files being displayed from index `start` up to (but
+// not including) index `end`. IDs aren't in display order, so this can only be
+// done a word of the selection bitset at a time when it covers every file.
+//
+static void select_listed(bb_t *bb, int start, int end, int selected) {
+    if (start == 0 && end == bb->nfiles && bb->nfiles == bb->selection.nbits) {
+        bitset_set_range(&bb->selection, start, end, selected);
+    } else {
+        for (int i = start; i < end; i++)
+            bitset_set(&bb->selection, listed_id(bb, i), selected);
+    }
+    bb->dirty = 1;
+}
+
+//
+// Select or deselect all the visible files whose names match a pattern, which
+// is either a regular expression like "/re/" or space-separated globs.
+// Only the names already in memory are checked, so this doesn't touch the
+// filesystem.
+//
+static void select_matching(bb_t *bb, const char *patterns, int selected) {
+    regex_t re;
+    size_t len = strlen(patterns);
+    int is_regex = len >= 2 && patterns[0] == '/' && patterns[len - 1] == '/';
+    if (is_regex) {
+        char *expr = strndup(patterns + 1, len - 2);
+        int status = regcomp(&re, nonnull(expr), REG_EXTENDED | REG_NOSUB);
+        delete (&expr);
+        if (status != 0) {
+            flash_warn(bb, "Invalid regular expression: %s", patterns);
+            return;
+        }
+    }
+    for (int i = 0; i < bb->nfiles; i++) {
+        const char *name = bb->bigdir ? bigdir_name(bb->bigdir, i) : bb->files[i]->name;
+        if (is_regex ? regexec(&re, name, 0, NULL, 0) == 0 : matches_globs(patterns, name))
+            bitset_set(&bb->selection, listed_id(bb, i), selected);
+    }
+    if (is_regex) regfree(&re);
+    bb->dirty = 1;
+}
+
+//
+// Return the index of the first of the paths of selected files (see
+// flush_selection()) that doesn't sort before `path`.
+//
+static int selected_path_index(bb_t *bb, const char *path) {
+    int lo = 0, hi = bb->nselected_paths;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(bb->selected_paths[mid], path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
 //
 // Set the columns displayed by bb.
 //
@@ -915,6 +2476,7 @@ static void set_globs(bb_t *bb, const char *globs) {
     delete (&bb->globpats);
     bb->globpats = check_strdup(globs);
     setenv("BBGLOB", bb->globpats, 1);
+    bb->dirty = 1;
 }
 
 //
@@ -949,11 +2511,13 @@ static void set_scroll(bb_t *bb, int newscroll) {
 // Select or deselect a file.
 //
 static void set_selected(bb_t *bb, entry_t *e, int selected) {
-    if (IS_SELECTED(e) == selected) return;
+    if (IS_SELECTED(bb, e) == selected) return;
 
-    if (bb->nfiles > 0 && e != bb->files[bb->cursor]) bb->dirty = 1;
+    if (bb->nfiles > 0 && e->index != bb->cursor) bb->dirty = 1;
 
-    if (selected) {
+    if (IS_LISTED(e)) {
+        bitset_set(&bb->selection, e->id, selected);
+    } else if (selected) {
         LL_PREPEND(bb->selected, e, selected);
         ++bb->nselected;
     } else {
@@ -987,18 +2551,59 @@ static void set_sort(bb_t *bb, const char *sort) {
 //
 static void set_title(bb_t *bb) {
     char *home = getenv("HOME");
-    if (home && strncmp(bb->path, home, strlen(home)) == 0)
+    if (bb->viewing_selection) fputs("\033]2;" BB_NAME ": selected files\007", tty_out);
+    else if (home && strncmp(bb->path, home, strlen(home)) == 0)
         fprintf(tty_out, "\033]2;" BB_NAME ": ~%s\007", bb->path + strlen(home));
     else fprintf(tty_out, "\033]2;" BB_NAME ": %s\007", bb->path);
 }
 
 //
-// If the given entry is not viewed or selected, remove it from the
+// Give each loaded file a random position for sorting by the random column.
+// The RNG is seeded with a hash of all the inodes in the listing, so the
+// order stays the same when the listing is reloaded.
+//
+static void shuffle_files(bb_t *bb) {
+    // This hash algorithm is based on Python's frozenset hashing
+    unsigned long seed = (unsigned long)bb->nloaded * 1927868237UL;
+    for (int i = 0; i < bb->nloaded; i++)
+        seed ^= ((bb->loaded[i]->info.st_ino ^ 89869747UL) ^ (bb->loaded[i]->info.st_ino << 16)) * 3644798167UL;
+    srand((unsigned int)seed);
+    for (int i = 0; i < bb->nloaded; i++) {
+        int j = rand() % (i + 1); // This introduces some RNG bias, but it's not important here
+        bb->loaded[i]->shufflepos = bb->loaded[j]->shufflepos;
+        bb->loaded[j]->shufflepos = i;
+    }
+}
+
+//
+// Split a key binding definition ("<keys>:<script>", where the script may
+// start with a "# <description>" line) in place. Return 1 if successful, or 0
+// if there are no keys or no script.
+//
+static int split_binding(char *def, char **keys, char **script, char **description) {
+    *keys = trim(def);
+    *script = *description = NULL;
+    if (!*keys || !(*keys)[0]) return 0;
+    *script = strchr(*keys + 1, ':');
+    if (!*script) return 0;
+    **script = '\0';
+    *script = trim(*script + 1);
+    if ((*script)[0] == '#') {
+        *description = trim(strsep(script, "\n") + 1);
+        if (!*script) *script = (char *)"";
+        else *script = trim(*script);
+    } else *description = *script;
+    return 1;
+}
+
+//
+// If the given entry is not listed or selected, remove it from the
 // hash, free it, and return 1.
 //
 static int try_free_entry(entry_t *e) {
-    if (IS_SELECTED(e) || IS_VIEWED(e) || !IS_LOADED(e)) return 0;
+    if (e->selected.atme || IS_VIEWED(e) || IS_LISTED(e) || !IS_LOADED(e)) return 0;
     LL_REMOVE(e, hash);
+    mem_release(&entry_pool, entry_size(e));
     delete (&e);
     return 1;
 }
@@ -1007,10 +2612,61 @@ static int try_free_entry(entry_t *e) {
 // Sort the files in bb according to bb's settings.
 //
 static void sort_files(bb_t *bb) {
-    qsort(bb->files, (size_t)bb->nfiles, sizeof(entry_t *), compare_files);
-    for (int i = 0; i < bb->nfiles; i++)
-        bb->files[i]->index = i;
-    bb->dirty = 1;
+    ALLOC_PHASE(ALLOC_SORT);
+    if (bb->bigdir) {
+        const char *name = strchr(bb->sort, COL_NAME);
+        bigdir_sort(bb->bigdir, name && name[-1] == '-' ? -1 : 1, bb->interleave_dirs);
+        filter_files(bb);
+        return;
+    }
+    if (!use_cached_sort_order(bb)) {
+        qsort(bb->loaded, (size_t)bb->nloaded, sizeof(entry_t *), compare_files);
+        cache_sort_order(bb);
+    }
+    filter_files(bb);
+}
+
+//
+// Start renaming the selected files: show them all (see view_selection()) and
+// take the keys that are pressed as the pattern and replacement for renaming
+// them, until the renaming is committed or cancelled (see handle_rename_key()).
+//
+static void start_renaming(bb_t *bb) {
+    if (bb->renaming) return;
+    if (bb->nselected + bb->nselected_paths + bb->selection.count == 0) {
+        flash_warn(bb, "No files are selected to rename");
+        return;
+    }
+    int was_viewing_selection = bb->viewing_selection;
+    view_selection(bb);
+    bb->renaming = rename_new(bb->nloaded);
+    bb->renaming->was_viewing_selection = was_viewing_selection;
+}
+
+//
+// Stop renaming the selected files and go back to the listing that was shown
+// before.
+//
+static void stop_renaming(bb_t *bb) {
+    int was_viewing_selection = bb->renaming->was_viewing_selection;
+    rename_free(bb->renaming);
+    bb->renaming = NULL;
+    if (was_viewing_selection) view_selection(bb);
+    else populate_files(bb, bb->path);
+}
+
+//
+// Remove a path from the paths of selected files (see flush_selection()), and
+// return whether it was there.
+//
+static int take_selected_path(bb_t *bb, const char *path) {
+    if (bb->nselected_paths == 0) return 0;
+    int i = selected_path_index(bb, path);
+    if (i >= bb->nselected_paths || !streq(bb->selected_paths[i], path)) return 0;
+    delete (&bb->selected_paths[i]);
+    memmove(&bb->selected_paths[i], &bb->selected_paths[i + 1], sizeof(char *) * (size_t)(bb->nselected_paths - i - 1));
+    --bb->nselected_paths;
+    return 1;
 }
 
 //
@@ -1028,11 +2684,123 @@ static char *trim(char *s) {
 }
 
 //
-// Hanlder for SIGWINCH events
+// Keep the stdout/stderr buffers under OUTPUT_BUFFER_MAX by discarding the
+// oldest half of the output when it gets too big.
 //
-static void update_term_size(int sig) {
-    (void)sig;
-    ioctl(STDIN_FILENO, TIOCGWINSZ, &winsize);
+static void trim_output_buffers(void) {
+    FOREACH(outbuf_t *, ob, output_buffers) {
+        if (ob->tmp_fd == -1) continue;
+        fflush(ob->orig_fd == STDOUT_FILENO ? stdout : stderr);
+        struct stat info;
+        if (fstat(ob->tmp_fd, &info) != 0) continue;
+        if (info.st_size > OUTPUT_BUFFER_MAX) {
+            // The tail is moved to the start of the file. Since the redirected
+            // stdout/stderr share the file offset with tmp_fd, seeking moves
+            // where the next output gets written too.
+            off_t keep = OUTPUT_BUFFER_MAX / 2;
+            static char buf[1 << 16];
+            for (off_t pos = 0; pos < keep;) {
+                ssize_t got = pread(ob->tmp_fd, buf, (size_t)MIN(keep - pos, (off_t)sizeof(buf)),
+                                    info.st_size - keep + pos);
+                if (got <= 0 || pwrite(ob->tmp_fd, buf, (size_t)got, pos) != got) break;
+                pos += got;
+            }
+            if (ftruncate(ob->tmp_fd, keep) == 0) {
+                lseek(ob->tmp_fd, keep, SEEK_SET);
+                ob->dropped += info.st_size - keep;
+                info.st_size = keep;
+            }
+        }
+        mem_release(&output_pool, (size_t)ob->size);
+        ob->size = info.st_size;
+        mem_charge(&output_pool, (size_t)ob->size);
+    }
+}
+
+//
+// Update the cached terminal size
+//
+static void update_term_size(void) { ioctl(STDIN_FILENO, TIOCGWINSZ, &winsize); }
+
+//
+// If the current sort settings (or their exact reverse) were used recently,
+// put bb->loaded in that order without sorting and return 1, otherwise 0.
+//
+static int use_cached_sort_order(bb_t *bb) {
+    if (columns_have_cache(bb->sort, COLUMN_VOLATILE)) return 0;
+    FOREACH(__typeof__(&sort_orders[0]), o, sort_orders) {
+        if (!o->order || o->interleave_dirs != bb->interleave_dirs) continue;
+        if (streq(o->sort, bb->sort)) {
+            memcpy(bb->loaded, o->order, (size_t)bb->nloaded * sizeof(entry_t *));
+            o->lastused = ++sort_clock;
+            return 1;
+        }
+    }
+    FOREACH(__typeof__(&sort_orders[0]), o, sort_orders) {
+        if (!o->order || o->interleave_dirs != bb->interleave_dirs || strlen(o->sort) != strlen(bb->sort)) continue;
+        int reversed = 1;
+        for (int i = 0; bb->sort[i] && reversed; i += 2)
+            reversed = bb->sort[i + 1] == o->sort[i + 1] && bb->sort[i] != o->sort[i];
+        if (!reversed) continue;
+        // Directories stay at the top when they're not interleaved, so the
+        // directories and files are reversed separately:
+        int ndirs = 0;
+        if (!bb->interleave_dirs)
+            while (ndirs < bb->nloaded && E_ISDIR(o->order[ndirs]))
+                ++ndirs;
+        for (int i = 0; i < ndirs; i++)
+            bb->loaded[i] = o->order[ndirs - 1 - i];
+        for (int i = ndirs; i < bb->nloaded; i++)
+            bb->loaded[i] = o->order[bb->nloaded - 1 - (i - ndirs)];
+        o->lastused = ++sort_clock;
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Show all the selected files (from any directory) as the file listing. The
+// entries that are already loaded are used as-is, so nothing is re-read from
+// the filesystem. The listing's files are shown by their full paths and stay
+// listed when they're deselected, until the view is refreshed or left.
+//
+static void view_selection(bb_t *bb) {
+    flush_selection(bb);
+    clear_listing(bb);
+    // The files that are selected by path need entries to be shown:
+    char **paths = bb->selected_paths;
+    int npaths = bb->nselected_paths;
+    bb->selected_paths = NULL;
+    bb->nselected_paths = 0;
+    for (int i = 0; i < npaths; i++) {
+        entry_t *e = load_entry(bb, paths[i]);
+        if (e) set_selected(bb, e, 1);
+        delete (&paths[i]);
+    }
+    delete (&paths);
+    bb->dirty = 1;
+    bb->viewing_selection = 1;
+    bb->loaded_all = 1;
+    set_title(bb);
+    links_new_generation();
+    xattrs_new_generation();
+    clear_sort_orders();
+    bb->loaded = new (entry_t * [(size_t)MAX(bb->nselected, 1)]);
+    bb->nloaded = bb->nselected;
+    // bb->selected is in most-recent order, so the first selected gets ID 0:
+    for (int i = bb->nloaded - 1; bb->selected; i--) {
+        entry_t *e = bb->selected;
+        LL_REMOVE(e, selected);
+        e->name = e->fullname;
+        e->listed = 1;
+        e->id = i;
+        bb->loaded[i] = e;
+    }
+    bb->nselected = 0;
+    bitset_resize(&bb->selection, bb->nloaded);
+    bitset_set_range(&bb->selection, 0, bb->nloaded, 1);
+    shuffle_files(bb);
+    sort_files(bb);
 }
 
 //
@@ -1088,11 +2856,10 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    struct sigaction sa_winch = {.sa_handler = &update_term_size};
+    struct sigaction sa_winch = {.sa_handler = &handle_winch};
     sigaction(SIGWINCH, &sa_winch, NULL);
-    update_term_size(0);
     // Wait 100us at a time for terminal to initialize if necessary
-    while (winsize.ws_row == 0)
+    for (update_term_size(); winsize.ws_row == 0; update_term_size())
         usleep(100);
 
     // Set up environment variables
@@ -1141,9 +2908,15 @@ int main(int argc, char *argv[]) {
 
     atexit(cleanup);
 
+    mem_register(&output_pool);
     FOREACH(outbuf_t *, ob, output_buffers) {
-        sprintf(ob->filename, "%s/" BB_NAME ".%s.XXXXXX", getenv("TMPDIR"), ob->name);
-        ob->tmp_fd = nonnegative(mkostemp(ob->filename, O_RDWR), "Couldn't create error file");
+#ifdef __linux__
+        ob->tmp_fd = memfd_create(ob->name, MFD_CLOEXEC);
+#endif
+        if (ob->tmp_fd == -1) {
+            sprintf(ob->filename, "%s/" BB_NAME ".%s.XXXXXX", getenv("TMPDIR"), ob->name);
+            ob->tmp_fd = nonnegative(mkostemp(ob->filename, O_RDWR), "Couldn't create error file");
+        }
         ob->dup_fd = nonnegative(dup(ob->orig_fd));
         nonnegative(dup2(ob->tmp_fd, ob->orig_fd), "Couldn't redirect error output");
     }
@@ -1167,12 +2940,23 @@ int main(int argc, char *argv[]) {
         .history = NULL,
     };
     current_bb = &bb;
+    mem_register(&entry_pool);
+    links_init();
+    xattrs_init();
+    colors_init(getenv("LS_COLORS"));
+    mem_register(&sort_pool);
+    mem_watch_pressure();
     set_globs(&bb, "*");
     init_term();
     bb_browse(&bb, argc, argv);
     cleanup(); // Optional, but this allows us to write directly to stdout instead of the buffer
 
-    if (bb.selected && print_selection) {
+    flush_selection(&bb);
+    if (print_selection) {
+        for (int i = 0; i < bb.nselected_paths; i++) {
+            write(STDOUT_FILENO, bb.selected_paths[i], strlen(bb.selected_paths[i]));
+            write(STDOUT_FILENO, &sep, 1);
+        }
         for (entry_t *e = bb.selected; e; e = e->selected.next) {
             write(STDOUT_FILENO, e->fullname, strlen(e->fullname));
             write(STDOUT_FILENO, &sep, 1);
@@ -1185,6 +2969,9 @@ int main(int argc, char *argv[]) {
     populate_files(&bb, NULL);
     while (bb.selected)
         set_selected(&bb, bb.selected, 0);
+    clear_selected_paths(&bb);
+    bitset_free(&bb.selection);
+    bitset_free(&drag.original);
     delete (&bb.globpats);
     for (bb_history_t *next; bb.history; bb.history = next) {
         next = bb.history->next;
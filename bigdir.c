@@ -0,0 +1,283 @@
+//
+// bigdir.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of listings for directories that are
+// too big to hold an entry for every file in memory. The names are spilled to
+// a temporary file, and entries are loaded on demand for a window around the
+// part of the listing being used (normally the part that's on screen).
+//
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bigdir.h"
+#include "utils.h"
+
+// Each name is stored in the map as "<type><name>\0", where <type> is 'd' for
+// directories and 'f' for everything else (including symbolic links).
+#define IS_DIR_RECORD(r) ((r)[0] == 'd')
+
+// The listing currently being sorted or searched:
+static const bigdir_t *sorting = NULL;
+
+//
+// Compare two names in the map according to the sort settings.
+//
+static int compare_records(const char *r1, const char *r2) {
+    if (!sorting->interleave_dirs && IS_DIR_RECORD(r1) != IS_DIR_RECORD(r2)) return IS_DIR_RECORD(r1) ? -1 : 1;
+    return sorting->sign * compare_names(r1 + 1, r2 + 1);
+}
+
+static int compare_ids(const void *v1, const void *v2) {
+    return compare_records(sorting->map + sorting->offsets[*(const int *)v1],
+                           sorting->map + sorting->offsets[*(const int *)v2]);
+}
+
+//
+// Open an anonymous temporary file to spill a listing into. This uses $TMPDIR
+// or /var/tmp, which (unlike /tmp) is usually not held in memory.
+//
+static int open_spill_file(void) {
+    const char *tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !tmpdir[0]) tmpdir = "/var/tmp";
+    int fd = -1;
+#ifdef O_TMPFILE
+    if ((fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0) return fd;
+#endif
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/" BB_NAME "-listing.XXXXXX", tmpdir);
+    fd = mkostemp(filename, O_CLOEXEC);
+    if (fd >= 0) unlink(filename);
+    return fd;
+}
+
+//
+// Unload an entry that is no longer in the window.
+//
+static void unload_entry(bigdir_t *d, entry_t *e) {
+    e->index = -1;
+    e->listed = 0;
+    d->unload(e);
+}
+
+//
+// Unload all the entries in the window (e.g. because the order changed).
+//
+static void unload_window(bigdir_t *d) {
+    FOREACH(entry_t **, e, d->window) {
+        if (*e) unload_entry(d, *e);
+        *e = NULL;
+    }
+}
+
+//
+// Return the type of a file in a directory for its record in the map.
+//
+static char record_type(DIR *dir, const char *name) {
+    struct stat info;
+    return fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode) ? 'd' : 'f';
+}
+
+//
+// Move the records that were kept in memory (in `buf`, written by `mem`) to a
+// spill file, looking up the types that weren't known, and return a stream
+// for writing the rest of the records to the spill file.
+//
+static FILE *spill_records(DIR *dir, FILE *mem, char **buf, size_t *buflen, int fd) {
+    fclose(mem);
+    FILE *f = nonnull(fdopen(nonnegative(dup(fd)), "w"));
+    for (const char *r = *buf; r < *buf + *buflen; r += strlen(r) + 1) {
+        fputc(r[0] == '?' ? record_type(dir, r + 1) : r[0], f);
+        fputs(r + 1, f);
+        fputc('\0', f);
+    }
+    delete (buf);
+    return f;
+}
+
+//
+// If loading entries for every file in the directory at `path` would take more
+// than `max_bytes` of memory, return a listing of the directory with entries
+// loaded and unloaded by the given functions. The listing needs to be sorted
+// and filtered before it's used. Otherwise, return NULL, and store the files'
+// records (see IS_DIR_RECORD(), but with '?' for types that aren't known) in
+// `records` and how many there are in `count`, so that the directory doesn't
+// need to be read again to load the files (`records` is NULL if it couldn't
+// be read). The records need to be freed by the caller.
+//
+bigdir_t *bigdir_open(const char *path, size_t max_bytes, entry_t *(*load)(const char *name),
+                      int (*unload)(entry_t *e), char **records, int *nrecords) {
+    *records = NULL;
+    *nrecords = 0;
+    DIR *dir = opendir(path);
+    if (!dir) return NULL;
+    // The records are kept in memory until the directory turns out to be too big:
+    char *buf = NULL;
+    size_t buflen = 0, pathlen = strlen(path), needed = 0, names_size = 0;
+    FILE *f = nonnull(open_memstream(&buf, &buflen));
+    int fd = -1, count = 0;
+    struct dirent *dp;
+    while (count < INT_MAX / 2 && (dp = readdir(dir))) {
+        if (fd < 0 && needed <= max_bytes) {
+            needed += sizeof(entry_t) + pathlen + strlen(dp->d_name) + 2 + 2 * sizeof(entry_t *);
+            if (needed > max_bytes && (fd = open_spill_file()) >= 0) f = spill_records(dir, f, &buf, &buflen, fd);
+        }
+        char type = dp->d_type == DT_DIR ? 'd' : (dp->d_type == DT_UNKNOWN ? '?' : 'f');
+        fputc(type == '?' && fd >= 0 ? record_type(dir, dp->d_name) : type, f);
+        fputs(dp->d_name, f);
+        fputc('\0', f);
+        names_size += strlen(dp->d_name) + 2;
+        ++count;
+    }
+    int truncated = count == INT_MAX / 2 && readdir(dir) != NULL;
+    closedir(dir);
+    if (fd < 0) { // Small enough to load every file
+        fclose(f);
+        *records = buf;
+        *nrecords = count;
+        return NULL;
+    }
+
+    size_t offsets_start = (names_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    size_t mapsize = offsets_start + (size_t)count * (sizeof(uint64_t) + 2 * sizeof(int));
+    char *map = MAP_FAILED;
+    if (fclose(f) == 0 && ftruncate(fd, (off_t)mapsize) == 0)
+        map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    bigdir_t *d = new (bigdir_t);
+    d->fd = fd;
+    d->map = map;
+    d->mapsize = mapsize;
+    d->offsets = (uint64_t *)(map + offsets_start);
+    d->sorted = (int *)(d->offsets + count);
+    d->shown = d->sorted + count;
+    d->count = count;
+    d->truncated = truncated;
+    d->sign = 1;
+    d->load = load;
+    d->unload = unload;
+    uint64_t offset = 0;
+    for (int i = 0; i < count; i++) {
+        d->offsets[i] = offset;
+        d->sorted[i] = i;
+        offset += strlen(map + offset + 1) + 2;
+    }
+    return d;
+}
+
+//
+// Unload all of a listing's entries and free the listing.
+//
+void bigdir_close(bigdir_t *d) {
+    unload_window(d);
+    munmap(d->map, d->mapsize);
+    close(d->fd);
+    delete (&d);
+}
+
+//
+// Return the entry for the i-th file being displayed, loading it if needed.
+// The window of loaded entries is moved to be centered on `i` if `i` is
+// outside of it.
+//
+entry_t *bigdir_entry(bigdir_t *d, int i) {
+    if (i < d->window_start || i >= d->window_start + BIGDIR_WINDOW) {
+        int start = MAX(0, i - BIGDIR_WINDOW / 2);
+        entry_t *window[BIGDIR_WINDOW] = {NULL};
+        for (int j = 0; j < BIGDIR_WINDOW; j++) {
+            if (!d->window[j]) continue;
+            int index = d->window_start + j;
+            if (start <= index && index < start + BIGDIR_WINDOW) window[index - start] = d->window[j];
+            else unload_entry(d, d->window[j]);
+        }
+        memcpy(d->window, window, sizeof(window));
+        d->window_start = start;
+    }
+    entry_t **e = &d->window[i - d->window_start];
+    if (!*e) {
+        *e = d->load(bigdir_name(d, i));
+        (*e)->index = i;
+        (*e)->id = d->shown[i];
+        (*e)->listed = 1;
+    }
+    return *e;
+}
+
+//
+// Return the ID of the i-th file being displayed.
+//
+int bigdir_id(bigdir_t *d, int i) { return d->shown[i]; }
+
+//
+// Return the name of the i-th file being displayed.
+//
+const char *bigdir_name(bigdir_t *d, int i) { return bigdir_id_name(d, d->shown[i]); }
+
+//
+// Return the name of the file with the given ID.
+//
+const char *bigdir_id_name(bigdir_t *d, int id) { return d->map + d->offsets[id] + 1; }
+
+//
+// Sort the names in a listing by name, in the given direction, with or without
+// directories first. The listing needs to be filtered afterwards.
+//
+void bigdir_sort(bigdir_t *d, int sign, int interleave_dirs) {
+    unload_window(d);
+    d->sign = sign;
+    d->interleave_dirs = interleave_dirs;
+    d->nshown = 0;
+    sorting = d;
+    qsort(d->sorted, (size_t)d->count, sizeof(int), compare_ids);
+}
+
+//
+// Display the files (in sorted order) whose names `keep(arg, name)` returns
+// nonzero for. Return the new index of the file that was at index `cursor`,
+// or of the next file after it that's still displayed.
+//
+int bigdir_filter(bigdir_t *d, int (*keep)(const char *arg, const char *name), const char *arg, int cursor) {
+    int old = (cursor >= 0 && cursor < d->nshown) ? d->shown[cursor] : -1;
+    unload_window(d);
+    int newcur = 0;
+    d->nshown = 0;
+    for (int i = 0; i < d->count; i++) {
+        if (d->sorted[i] == old) newcur = d->nshown;
+        if (keep(arg, bigdir_id_name(d, d->sorted[i]))) d->shown[d->nshown++] = d->sorted[i];
+    }
+    return newcur;
+}
+
+//
+// Return the index of the displayed file with the given name, or if there is
+// no such file, the index where it would be.
+//
+int bigdir_find(bigdir_t *d, const char *name, int isdir) {
+    char key[PATH_MAX + 2];
+    snprintf(key, sizeof(key), "%c%s", isdir ? 'd' : 'f', name);
+    sorting = d;
+    int lo = 0, hi = d->nshown;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compare_records(d->map + d->offsets[d->shown[mid]], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    // Names that only differ by case sort the same, so check all of them:
+    for (int i = lo; i < d->nshown && compare_records(d->map + d->offsets[d->shown[i]], key) == 0; i++)
+        if (streq(bigdir_name(d, i), name)) return i;
+    return lo;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,60 @@
+//
+// bigdir.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for listing directories that are too big to
+// hold an entry for every file in memory.
+//
+
+#ifndef FILE_BIGDIR__H
+#define FILE_BIGDIR__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+// How many entries are kept loaded around the most recently used position:
+#define BIGDIR_WINDOW 1024
+
+//
+// A listing of a big directory. Only the names of the files (and whether they
+// are directories) are kept for the whole directory, in a temporary file that
+// is mapped into memory, so the kernel can page it out. Full entries are only
+// loaded for a window of the listing.
+//
+typedef struct bigdir_s {
+    int fd;
+    char *map;
+    size_t mapsize;
+    // Offsets of the names in the map, indexed by each file's ID (its position
+    // in the directory), and the IDs of the files in sorted order, and of the
+    // ones among them that are being displayed:
+    uint64_t *offsets;
+    int *sorted, *shown;
+    int count, nshown;
+    int sign, interleave_dirs;
+    int truncated; // Whether the directory had too many files to list all of them
+    entry_t *(*load)(const char *name);
+    int (*unload)(entry_t *e);
+    entry_t *window[BIGDIR_WINDOW];
+    int window_start;
+} bigdir_t;
+
+// Get the i-th file being displayed (loading it if necessary):
+#define FILE_AT(bb, i) ((bb)->bigdir ? bigdir_entry((bb)->bigdir, i) : (bb)->files[i])
+
+bigdir_t *bigdir_open(const char *path, size_t max_bytes, entry_t *(*load)(const char *name),
+                      int (*unload)(entry_t *e), char **records, int *nrecords);
+void bigdir_close(bigdir_t *d);
+entry_t *bigdir_entry(bigdir_t *d, int i);
+int bigdir_id(bigdir_t *d, int i);
+const char *bigdir_name(bigdir_t *d, int i);
+const char *bigdir_id_name(bigdir_t *d, int id);
+void bigdir_sort(bigdir_t *d, int sign, int interleave_dirs);
+int bigdir_filter(bigdir_t *d, int (*keep)(const char *arg, const char *name), const char *arg, int cursor);
+int bigdir_find(bigdir_t *d, const char *name, int isdir);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
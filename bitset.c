@@ -0,0 +1,114 @@
+//
+// bitset.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of bitsets. Operations on ranges of
+// bits work a word (64 bits) at a time, and the number of set bits is kept
+// up to date with popcount, so bulk selection is fast even for huge listings.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitset.h"
+#include "utils.h"
+
+//
+// Return a mask of the bits in a word from bit `start` up to (but not
+// including) bit `end`, where 0 <= start < end <= 64.
+//
+static uint64_t word_mask(int start, int end) {
+    uint64_t mask = end == 64 ? ~(uint64_t)0 : (((uint64_t)1 << end) - 1);
+    return mask & ~(((uint64_t)1 << start) - 1);
+}
+
+//
+// Resize a bitset to hold `nbits` bits, all cleared.
+//
+void bitset_resize(bitset_t *b, int nbits) {
+    size_t nwords = (size_t)(nbits + 63) / 64;
+    b->words = grow(b->words, MAX(nwords, 1));
+    memset(b->words, 0, MAX(nwords, 1) * sizeof(uint64_t));
+    b->nbits = nbits;
+    b->count = 0;
+}
+
+//
+// Free the memory used by a bitset.
+//
+void bitset_free(bitset_t *b) {
+    delete (&b->words);
+    b->nbits = b->count = 0;
+}
+
+//
+// Set or clear a single bit.
+//
+void bitset_set(bitset_t *b, int i, int value) {
+    uint64_t bit = (uint64_t)1 << (i % 64);
+    if (!(b->words[i / 64] & bit) == !value) return;
+    b->words[i / 64] ^= bit;
+    b->count += value ? 1 : -1;
+}
+
+//
+// Set or clear the bits from `start` up to (but not including) `end`.
+//
+void bitset_set_range(bitset_t *b, int start, int end, int value) {
+    for (int i = start; i < end;) {
+        int w = i / 64, next = MIN(end, (w + 1) * 64);
+        uint64_t mask = word_mask(i % 64, next - w * 64);
+        b->count -= __builtin_popcountll(b->words[w] & mask);
+        if (value) b->words[w] |= mask;
+        else b->words[w] &= ~mask;
+        b->count += __builtin_popcountll(b->words[w] & mask);
+        i = next;
+    }
+}
+
+//
+// Invert the bits from `start` up to (but not including) `end`.
+//
+void bitset_invert_range(bitset_t *b, int start, int end) {
+    for (int i = start; i < end;) {
+        int w = i / 64, next = MIN(end, (w + 1) * 64);
+        uint64_t mask = word_mask(i % 64, next - w * 64);
+        b->count -= __builtin_popcountll(b->words[w] & mask);
+        b->words[w] ^= mask;
+        b->count += __builtin_popcountll(b->words[w] & mask);
+        i = next;
+    }
+}
+
+//
+// Set the bits from an array of words (e.g. from another bitset of the same
+// size), and count them.
+//
+void bitset_load(bitset_t *b, const uint64_t *words) {
+    size_t nwords = (size_t)(b->nbits + 63) / 64;
+    memcpy(b->words, words, nwords * sizeof(uint64_t));
+    if (b->nbits % 64) b->words[nwords - 1] &= word_mask(0, b->nbits % 64);
+    b->count = 0;
+    for (size_t w = 0; w < nwords; w++)
+        b->count += __builtin_popcountll(b->words[w]);
+}
+
+//
+// Return the index of the first set bit at or after `i`, or -1 if there is none.
+//
+int bitset_next(const bitset_t *b, int i) {
+    if (i < 0) i = 0;
+    for (int w = i / 64; w * 64 < b->nbits; w++) {
+        uint64_t word = b->words[w];
+        if (w == i / 64) word &= ~(((uint64_t)1 << (i % 64)) - 1);
+        if (word) {
+            int found = w * 64 + __builtin_ctzll(word);
+            return found < b->nbits ? found : -1;
+        }
+    }
+    return -1;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,32 @@
+//
+// bitset.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for bitsets, which bb uses to keep track of
+// which files in the current listing are selected.
+//
+
+#ifndef FILE_BITSET__H
+#define FILE_BITSET__H
+
+#include <stdint.h>
+
+// A set of bits, which keeps count of how many bits are set:
+typedef struct {
+    uint64_t *words;
+    int nbits, count;
+} bitset_t;
+
+#define BITSET_GET(b, i) ((int)(((b)->words[(i) / 64] >> ((i) % 64)) & 1))
+
+void bitset_resize(bitset_t *b, int nbits);
+void bitset_free(bitset_t *b);
+void bitset_set(bitset_t *b, int i, int value);
+void bitset_set_range(bitset_t *b, int start, int end, int value);
+void bitset_invert_range(bitset_t *b, int start, int end);
+void bitset_load(bitset_t *b, const uint64_t *words);
+int bitset_next(const bitset_t *b, int i);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
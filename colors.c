@@ -0,0 +1,214 @@
+//
+// colors.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of file colors. $LS_COLORS is parsed
+// once at startup into a table of colors for each kind of file, plus a trie of
+// reversed filename suffixes (e.g. "*.tar.gz"), so looking up a file's color
+// is a walk over the end of its name. Each entry's color is only looked up
+// once, and cached in the entry.
+//
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "colors.h"
+#include "draw.h"
+#include "links.h"
+#include "utils.h"
+
+#define MAX_COLORS 255
+
+// The kinds of files that can be given colors (other than by name):
+typedef enum {
+    KIND_NORMAL = 0,
+    KIND_FILE,
+    KIND_DIR,
+    KIND_LINK,
+    KIND_ORPHAN,
+    KIND_FIFO,
+    KIND_SOCKET,
+    KIND_BLOCK,
+    KIND_CHAR,
+    KIND_EXEC,
+    KIND_SETUID,
+    KIND_SETGID,
+    KIND_STICKY,
+    KIND_OTHER_WRITABLE,
+    KIND_STICKY_OTHER_WRITABLE,
+    NUM_KINDS,
+} kind_e;
+
+// The LS_COLORS keys for each kind, and which kind to fall back to if a kind
+// has no color:
+static const struct {
+    const char *key;
+    kind_e fallback;
+} kinds[NUM_KINDS] = {
+    [KIND_NORMAL] = {"no", KIND_NORMAL},         [KIND_FILE] = {"fi", KIND_NORMAL},
+    [KIND_DIR] = {"di", KIND_NORMAL},            [KIND_LINK] = {"ln", KIND_NORMAL},
+    [KIND_ORPHAN] = {"or", KIND_LINK},           [KIND_FIFO] = {"pi", KIND_FILE},
+    [KIND_SOCKET] = {"so", KIND_FILE},           [KIND_BLOCK] = {"bd", KIND_FILE},
+    [KIND_CHAR] = {"cd", KIND_FILE},             [KIND_EXEC] = {"ex", KIND_FILE},
+    [KIND_SETUID] = {"su", KIND_EXEC},           [KIND_SETGID] = {"sg", KIND_EXEC},
+    [KIND_STICKY] = {"st", KIND_DIR},            [KIND_OTHER_WRITABLE] = {"ow", KIND_DIR},
+    [KIND_STICKY_OTHER_WRITABLE] = {"tw", KIND_OTHER_WRITABLE},
+};
+
+// A node in the trie of filename suffixes, which are stored backwards, so
+// ".tar.gz" is found by following 'z', 'g', '.', 'r', ... from the root.
+typedef struct {
+    char c;
+    unsigned char color;
+    int child, sibling;
+} suffix_node_t;
+
+// Color escape sequences (index 0 means "no color"):
+static char *colors[MAX_COLORS + 1];
+static int ncolors = 0;
+static unsigned char kind_colors[NUM_KINDS];
+static suffix_node_t *suffixes = NULL;
+static int nsuffixes = 0;
+
+//
+// Return the index of a color escape sequence, adding it to the color table
+// if it's not already there (or returning 0 if the table is full).
+//
+static unsigned char add_color(const char *color) {
+    for (int i = 1; i <= ncolors; i++)
+        if (streq(colors[i], color)) return (unsigned char)i;
+    if (ncolors == MAX_COLORS) return 0;
+    colors[++ncolors] = check_strdup(color);
+    return (unsigned char)ncolors;
+}
+
+//
+// Return the index of the color with the given SGR parameters (e.g. "01;34"),
+// or 0 if they aren't valid.
+//
+static unsigned char add_sgr_color(const char *params) {
+    char buf[64];
+    if (strlen(params) > sizeof(buf) - 4 || params[strspn(params, "0123456789;")]) return 0;
+    sprintf(buf, "\033[%sm", params);
+    return add_color(buf);
+}
+
+//
+// Add a filename suffix with the given color to the trie of suffixes.
+// Suffixes are matched case-insensitively.
+//
+static void add_suffix(const char *suffix, unsigned char color) {
+    if (!suffixes) {
+        suffixes = new (suffix_node_t);
+        nsuffixes = 1;
+    }
+    int node = 0;
+    for (const char *p = suffix + strlen(suffix); p > suffix;) {
+        char c = tolower(*(--p));
+        int child = suffixes[node].child;
+        while (child && suffixes[child].c != c)
+            child = suffixes[child].sibling;
+        if (!child) {
+            suffixes = grow(suffixes, (size_t)nsuffixes + 1);
+            child = nsuffixes++;
+            suffixes[child] = (suffix_node_t){.c = c, .sibling = suffixes[node].child};
+            suffixes[node].child = child;
+        }
+        node = child;
+    }
+    suffixes[node].color = color;
+}
+
+//
+// Return the color of the longest suffix in the trie that matches a filename,
+// or 0 if none match.
+//
+static unsigned char match_suffix(const char *name) {
+    unsigned char color = 0;
+    int node = 0;
+    for (const char *p = name + strlen(name); suffixes && p > name;) {
+        char c = tolower(*(--p));
+        int child = suffixes[node].child;
+        while (child && suffixes[child].c != c)
+            child = suffixes[child].sibling;
+        if (!child) break;
+        node = child;
+        if (suffixes[node].color) color = suffixes[node].color;
+    }
+    return color;
+}
+
+//
+// Set up the file colors: bb's defaults, overridden by the colors in
+// `ls_colors` (in the format of $LS_COLORS, e.g. "di=01;34:*.tar=01;31"),
+// if it's not NULL. Keys that bb doesn't support are ignored.
+//
+void colors_init(const char *ls_colors) {
+    kind_colors[KIND_NORMAL] = add_color(NORMAL_COLOR);
+    kind_colors[KIND_DIR] = add_color(DIR_COLOR);
+    kind_colors[KIND_LINK] = add_color(LINK_COLOR);
+    kind_colors[KIND_EXEC] = add_color(EXECUTABLE_COLOR);
+    if (!ls_colors) return;
+
+    char *copy = check_strdup(ls_colors);
+    for (char *rule, *rest = copy; (rule = strsep(&rest, ":"));) {
+        char *key = strsep(&rule, "=");
+        if (!rule) continue;
+        unsigned char color = add_sgr_color(rule[0] ? rule : "0");
+        if (!color) continue;
+        if (key[0] == '*') {
+            if (key[1] && !strpbrk(key + 1, "*?[")) add_suffix(key + 1, color);
+            continue;
+        }
+        for (int k = 0; k < NUM_KINDS; k++)
+            if (streq(key, kinds[k].key)) kind_colors[k] = color;
+    }
+    delete (&copy);
+}
+
+//
+// Return the kind of file an entry is, for picking its color.
+//
+static kind_e entry_kind(entry_t *e) {
+    mode_t mode = e->info.st_mode;
+    if (S_ISLNK(mode)) {
+        // Only look up the link's target if broken links have their own color:
+        return kind_colors[KIND_ORPHAN] && !entry_linkedmode(e) ? KIND_ORPHAN : KIND_LINK;
+    } else if (S_ISDIR(mode)) {
+        if ((mode & S_ISVTX) && (mode & S_IWOTH)) return KIND_STICKY_OTHER_WRITABLE;
+        else if (mode & S_IWOTH) return KIND_OTHER_WRITABLE;
+        else if (mode & S_ISVTX) return KIND_STICKY;
+        return KIND_DIR;
+    } else if (S_ISFIFO(mode)) return KIND_FIFO;
+    else if (S_ISSOCK(mode)) return KIND_SOCKET;
+    else if (S_ISBLK(mode)) return KIND_BLOCK;
+    else if (S_ISCHR(mode)) return KIND_CHAR;
+    else if (mode & S_ISUID) return KIND_SETUID;
+    else if (mode & S_ISGID) return KIND_SETGID;
+    else if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return KIND_EXEC;
+    return KIND_FILE;
+}
+
+//
+// Return the color escape sequence for an entry. The color is looked up the
+// first time, and cached in the entry after that.
+//
+const char *entry_color(entry_t *e) {
+    if (!e->color) {
+        kind_e kind = entry_kind(e);
+        // Like ls, only plain files are colored by their names:
+        if (kind == KIND_FILE) e->color = match_suffix(e->name);
+        while (!e->color && kind != KIND_NORMAL) {
+            e->color = kind_colors[kind];
+            kind = kinds[kind].fallback;
+        }
+        if (!e->color) e->color = kind_colors[KIND_NORMAL];
+    }
+    return colors[e->color];
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
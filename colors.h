@@ -0,0 +1,19 @@
+//
+// colors.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for picking the colors of files, either
+// bb's defaults or the ones in $LS_COLORS.
+//
+
+#ifndef FILE_COLORS__H
+#define FILE_COLORS__H
+
+#include "types.h"
+
+void colors_init(const char *ls_colors);
+const char *entry_color(entry_t *e);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -3,6 +3,7 @@
 //
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,20 +11,62 @@
 #include <sys/stat.h>
 #include <time.h>
 
+#include "bigdir.h"
+#include "colors.h"
 #include "draw.h"
+#include "links.h"
+#include "owners.h"
+#include "rename.h"
 #include "terminal.h"
 #include "types.h"
 #include "utils.h"
+#include "xattrs.h"
+
+// The state being drawn (needed for the selection column):
+static const bb_t *drawing = NULL;
+
+// What's on each row of the listing on the screen: a hash of the file's path
+// (to find where it moved when the listing changes) and of the row's text (to
+// tell whether it needs to be redrawn). Zeroes mean the row is unknown.
+typedef struct {
+    uint64_t id, text;
+} drawn_row_t;
 
 column_t column_info[255] = {
-    ['*'] = {.name = "*", .render = col_selected},         ['n'] = {.name = "Name", .render = col_name, .stretchy = 1},
-    ['s'] = {.name = " Size", .render = col_size},         ['p'] = {.name = "Perm", .render = col_perm},
-    ['m'] = {.name = " Modified", .render = col_mreltime}, ['M'] = {.name = "     Modified     ", .render = col_mtime},
-    ['a'] = {.name = " Accessed", .render = col_areltime}, ['A'] = {.name = "     Accessed     ", .render = col_atime},
-    ['c'] = {.name = " Created", .render = col_creltime},  ['C'] = {.name = "     Created      ", .render = col_ctime},
-    ['r'] = {.name = "Random", .render = col_random},
+    ['*'] = {.name = "*", .render = col_selected, .compare = cmp_selected, .cache = COLUMN_VOLATILE},
+    ['n'] = {.name = "Name", .render = col_name, .compare = cmp_name, .stretchy = 1},
+    ['s'] = {.name = " Size", .render = col_size, .compare = cmp_size},
+    ['p'] = {.name = "Perm", .render = col_perm, .compare = cmp_perm},
+    ['m'] = {.name = " Modified", .render = col_mreltime, .compare = cmp_mtime, .cache = COLUMN_CLOCK},
+    ['M'] = {.name = "     Modified     ", .render = col_mtime, .compare = cmp_mtime},
+    ['a'] = {.name = " Accessed", .render = col_areltime, .compare = cmp_atime, .cache = COLUMN_CLOCK},
+    ['A'] = {.name = "     Accessed     ", .render = col_atime, .compare = cmp_atime},
+    ['c'] = {.name = " Created", .render = col_creltime, .compare = cmp_ctime, .cache = COLUMN_CLOCK},
+    ['C'] = {.name = "     Created      ", .render = col_ctime, .compare = cmp_ctime},
+    ['r'] = {.name = "Random", .render = col_random, .compare = cmp_random},
+    ['x'] = {.name = "Xattr",
+             .render = col_xattrs,
+             .compare = cmp_xattrs,
+             .needs = COLUMN_NEEDS_XATTRS,
+             .cache = COLUMN_VOLATILE},
+    ['u'] = {.name = "Owner   ",
+             .render = col_owner,
+             .compare = cmp_owner,
+             .needs = COLUMN_NEEDS_OWNERS,
+             .cache = COLUMN_VOLATILE},
+    ['g'] = {.name = "Group   ",
+             .render = col_group,
+             .compare = cmp_group,
+             .needs = COLUMN_NEEDS_OWNERS,
+             .cache = COLUMN_VOLATILE},
+    ['l'] = {.name = "Links", .render = col_links, .compare = cmp_links},
+    ['i'] = {.name = "     Inode", .render = col_inode, .compare = cmp_inode},
 };
 
+// Order larger numbers first (which is what sorting with '+' does for
+// everything but names):
+#define DESCENDING(a, b) ((a) == (b) ? 0 : ((a) < (b) ? 1 : -1))
+
 //
 // Left-pad a string with spaces.
 //
@@ -37,6 +80,16 @@ static void lpad(char *buf, int width) {
     }
 }
 
+//
+// Return how many columns a string takes up (counting each UTF-8 character as one).
+//
+static int text_width(const char *str) {
+    int width = 0;
+    for (const char *c = str; *c; ++c)
+        if ((*c & 0xC0) != 0x80) ++width;
+    return width;
+}
+
 //
 // Append a string to an existing string, but with escape sequences made explicit.
 //
@@ -105,6 +158,19 @@ static void timeago(char *buf, time_t t) {
     else sprintf(buf, "%d years", (int)delta / YEAR);
 }
 
+//
+// Draw a user or group name, or the ID if its name isn't known (yet).
+//
+static void draw_owner(char *buf, int width, char kind, unsigned int id) {
+    const char *name = owners_name(kind, id);
+    char idstr[16];
+    if (!name) {
+        sprintf(idstr, "%u", id);
+        name = idstr;
+    }
+    sprintf(buf, " %-*.*s", width - 1, width - 1, name);
+}
+
 void col_mreltime(entry_t *entry, const char *color, char *buf, int width) {
     (void)color;
     timeago(buf, entry->info.st_mtime);
@@ -140,10 +206,30 @@ void col_ctime(entry_t *entry, const char *color, char *buf, int width) {
 
 void col_selected(entry_t *entry, const char *color, char *buf, int width) {
     (void)width;
-    buf = stpcpy(buf, IS_SELECTED(entry) ? SELECTED_INDICATOR : NOT_SELECTED_INDICATOR);
+    buf = stpcpy(buf, IS_SELECTED(drawing, entry) ? SELECTED_INDICATOR : NOT_SELECTED_INDICATOR);
     buf = stpcpy(buf, color);
 }
 
+void col_group(entry_t *entry, const char *color, char *buf, int width) {
+    (void)color;
+    draw_owner(buf, width, OWNER_GROUP, (unsigned int)entry->info.st_gid);
+}
+
+void col_inode(entry_t *entry, const char *color, char *buf, int width) {
+    (void)color;
+    sprintf(buf, "%*llu", width, (unsigned long long)entry->info.st_ino);
+}
+
+void col_links(entry_t *entry, const char *color, char *buf, int width) {
+    (void)color;
+    sprintf(buf, "%*lu", width, (unsigned long)entry->info.st_nlink);
+}
+
+void col_owner(entry_t *entry, const char *color, char *buf, int width) {
+    (void)color;
+    draw_owner(buf, width, OWNER_USER, (unsigned int)entry->info.st_uid);
+}
+
 void col_perm(entry_t *entry, const char *color, char *buf, int width) {
     (void)color;
     (void)width;
@@ -176,6 +262,16 @@ void col_name(entry_t *entry, const char *color, char *buf, int width) {
 
     if (E_ISDIR(entry)) buf = stpcpy(buf, "/");
 
+    const rename_t *r = drawing->renaming;
+    if (r && entry->id < r->count && r->targets[entry->id]) { // The new name it'll be renamed to
+        const char *newcolor = r->conflicts[entry->id] ? RENAME_CONFLICT_COLOR : RENAME_COLOR;
+        buf = stpcpy(buf, "\033[2m → \033[22m");
+        buf = stpcpy(buf, newcolor);
+        buf = stpcpy_escaped(buf, strrchr(r->targets[entry->id], '/') + 1, newcolor);
+        buf = stpcpy(buf, color);
+        return;
+    }
+
     if (!entry->linkname) return;
 
     buf = stpcpy(buf, "\033[2m -> \033[3m");
@@ -183,17 +279,135 @@ void col_name(entry_t *entry, const char *color, char *buf, int width) {
     if (entry->link_no_esc) buf = stpcpy(buf, entry->linkname);
     else buf = stpcpy_escaped(buf, entry->linkname, color);
 
-    if (S_ISDIR(entry->linkedmode)) buf = stpcpy(buf, "/");
+    if (S_ISDIR(entry_linkedmode(entry))) buf = stpcpy(buf, "/");
 
     buf = stpcpy(buf, "\033[22;23m");
 }
 
+void col_xattrs(entry_t *entry, const char *color, char *buf, int width) {
+    (void)color;
+    // Like `ls -l`: '@' for extended attributes, '+' for ACLs, '.' for security labels
+    char indicators[4] = "", *p = indicators;
+    int flags = xattrs_get(entry, 1);
+    if (flags == XATTR_UNKNOWN) {
+        *p++ = '?';
+    } else if (flags & XATTR_ERROR) {
+        *p++ = '!';
+    } else {
+        if (flags & XATTR_OTHER) *p++ = '@';
+        if (flags & XATTR_ACL) *p++ = '+';
+        if (flags & XATTR_LABEL) *p++ = '.';
+    }
+    *p = '\0';
+    sprintf(buf, "%*s ", width - 1, indicators);
+}
+
+//
+// Return the information about files needed by the given columns (or sort
+// keys, since the '+' and '-' in those aren't columns).
+//
+unsigned int columns_needs(const char *keys) {
+    unsigned int needs = 0;
+    for (; *keys; keys++)
+        needs |= column_info[(int)*keys].needs;
+    return needs;
+}
+
+//
+// Return whether any of the given columns (or sort keys) stay the same for as
+// long as `cache` says.
+//
+int columns_have_cache(const char *keys, column_cache_e cache) {
+    for (; *keys; keys++)
+        if (column_info[(int)*keys].name && column_info[(int)*keys].cache == cache) return 1;
+    return 0;
+}
+
+//
+// Compare files by one of their times, most recent first.
+//
+static int compare_times(struct timespec t1, struct timespec t2) {
+    if (t1.tv_sec != t2.tv_sec) return DESCENDING(t1.tv_sec, t2.tv_sec);
+    return DESCENDING(t1.tv_nsec, t2.tv_nsec);
+}
+
+int cmp_atime(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return compare_times(get_atime(e1->info), get_atime(e2->info));
+}
+
+int cmp_ctime(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return compare_times(get_ctime(e1->info), get_ctime(e2->info));
+}
+
+int cmp_group(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return owners_compare(OWNER_GROUP, (unsigned int)e1->info.st_gid, (unsigned int)e2->info.st_gid);
+}
+
+int cmp_inode(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    if (e1->info.st_dev != e2->info.st_dev) return DESCENDING(e1->info.st_dev, e2->info.st_dev);
+    return DESCENDING(e1->info.st_ino, e2->info.st_ino);
+}
+
+int cmp_links(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return DESCENDING(e1->info.st_nlink, e2->info.st_nlink);
+}
+
+int cmp_mtime(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return compare_times(get_mtime(e1->info), get_mtime(e2->info));
+}
+
+int cmp_name(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return compare_names(e1->name, e2->name);
+}
+
+int cmp_owner(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return owners_compare(OWNER_USER, (unsigned int)e1->info.st_uid, (unsigned int)e2->info.st_uid);
+}
+
+int cmp_perm(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return DESCENDING(e1->info.st_mode & 0x3FF, e2->info.st_mode & 0x3FF);
+}
+
+int cmp_random(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return DESCENDING(e2->shufflepos, e1->shufflepos);
+}
+
+int cmp_selected(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    return DESCENDING(IS_SELECTED(bb, e1), IS_SELECTED(bb, e2));
+}
+
+int cmp_size(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return DESCENDING(e1->info.st_size, e2->info.st_size);
+}
+
+int cmp_xattrs(const bb_t *bb, entry_t *e1, entry_t *e2) {
+    (void)bb;
+    return DESCENDING(xattrs_cached(e1), xattrs_cached(e2));
+}
+
 //
 // Calculate the column widths.
 //
 int *get_column_widths(char columns[], int width) {
-    // TODO: maybe memoize
+    // Memoized, since this is needed for every row that's drawn:
     static int colwidths[16] = {0};
+    static char lastcolumns[MAX_COLS + 1] = {0};
+    static int lastwidth = -1;
+    if (width == lastwidth && streq(columns, lastcolumns)) return colwidths;
+    strcpy(lastcolumns, columns);
+    lastwidth = width;
+
     int space = width, nstretchy = 0;
     for (int c = 0; columns[c]; c++) {
         column_t col = column_info[(int)columns[c]];
@@ -260,29 +474,130 @@ void draw_row(FILE *out, char columns[], entry_t *entry, const char *color, int
     fputs("\033[0m", out);
 }
 
+//
+// Hash a row's path or contents, never returning 0 (which is used for unknown rows).
+//
+static uint64_t hash_row(const char *bytes, size_t len) {
+    uint64_t hash = hash_bytes(bytes, len);
+    return hash ? hash : 1;
+}
+
+//
+// Delete (if `n` < 0) or insert `-n` or `n` lines at row `y` of the listing
+// (which has `onscreen` rows), moving the rows below it within the listing's
+// scroll region, and keep track of what's on the rows that moved.
+//
+static void shift_rows(FILE *out, drawn_row_t *rows, int onscreen, int y, int n, int height) {
+    int count = MIN(n < 0 ? -n : n, onscreen - y);
+    if (count <= 0) return;
+    fprintf(out, "\033[3;%dr", height - 1);
+    move_cursor(out, 0, y + 2);
+    fprintf(out, "\033[%d%c\033[1;%dr", count, n < 0 ? 'M' : 'L', height);
+    if (n < 0) {
+        memmove(&rows[y], &rows[y + count], sizeof(drawn_row_t) * (size_t)(onscreen - y - count));
+        memset(&rows[onscreen - count], 0, sizeof(drawn_row_t) * (size_t)count);
+    } else {
+        memmove(&rows[y + count], &rows[y], sizeof(drawn_row_t) * (size_t)(onscreen - y - count));
+        memset(&rows[y], 0, sizeof(drawn_row_t) * (size_t)count);
+    }
+}
+
+//
+// When the listing has changed (e.g. files were added or removed when it was
+// refreshed), move the rows that are still on the screen to where their files
+// are now with the terminal's insert line and delete line operations, so only
+// the rows of files that weren't already on the screen need to be drawn.
+// The rows are matched up by finding the longest common subsequence of the
+// files on the screen and the files that will be, and since the whole screen
+// is compared, any number of changes between frames is handled at once.
+//
+static void move_rows(FILE *out, bb_t *bb, drawn_row_t *rows, int onscreen, int height) {
+    // The rows are moved while they're being matched up, so this needs a copy
+    // of what's on the screen now:
+    uint64_t *old = new (uint64_t[(size_t)onscreen]), *ids = new (uint64_t[(size_t)onscreen]);
+    for (int y = 0; y < onscreen; y++)
+        old[y] = rows[y].id;
+    for (int y = 0; y < onscreen && bb->scroll + y < bb->nfiles; y++) {
+        const char *path = FILE_AT(bb, bb->scroll + y)->fullname;
+        ids[y] = hash_row(path, strlen(path));
+    }
+    // lcs[i*(n+1)+j]: how many rows match between old rows i.. and new rows j..
+    int n = onscreen;
+    int *lcs = new (int[(size_t)((n + 1) * (n + 1))]);
+    for (int i = n - 1; i >= 0; i--) {
+        for (int j = n - 1; j >= 0; j--) {
+            if (old[i] && old[i] == ids[j]) lcs[i * (n + 1) + j] = 1 + lcs[(i + 1) * (n + 1) + j + 1];
+            else lcs[i * (n + 1) + j] = MAX(lcs[(i + 1) * (n + 1) + j], lcs[i * (n + 1) + j + 1]);
+        }
+    }
+    // Deletions and insertions are only done when there's a row below them
+    // to move (the rest are just drawn):
+    int deleted = 0, inserted = 0;
+    for (int i = 0, j = 0, y = 0; i < n && j < n;) {
+        if (old[i] && old[i] == ids[j]) {
+            shift_rows(out, rows, onscreen, y, -deleted, height);
+            shift_rows(out, rows, onscreen, y, inserted, height);
+            y += inserted + 1;
+            deleted = inserted = 0;
+            ++i, ++j;
+        } else if (lcs[(i + 1) * (n + 1) + j] >= lcs[i * (n + 1) + j + 1]) {
+            ++deleted, ++i;
+        } else {
+            ++inserted, ++j;
+        }
+    }
+    delete (&lcs);
+    delete (&ids);
+    delete (&old);
+}
+
 //
 // Draw everything to the screen.
-// If `bb->dirty` is false, then use terminal scrolling to move the file
-// listing around and only update the files that have changed.
+// If `bb->dirty` is false, then use terminal scrolling (or inserting and
+// deleting lines, if `bb->listing_changed`) to move the file listing around
+// and only update the files that have changed.
+// The terminal size is passed in (rather than queried here) so that it's only
+// fetched when the terminal is resized.
 //
-void render(FILE *out, bb_t *bb) {
+void render(FILE *out, bb_t *bb, int width, int height) {
+    ALLOC_PHASE(ALLOC_RENDER);
     static int lastcursor = -1, lastscroll = -1;
     static struct winsize oldsize = {0};
+    static drawn_row_t *rows = NULL;
+    static char *rowbuf = NULL;
+    static size_t rowsize = 0;
+    static FILE *rowfile = NULL;
 
-    struct winsize winsize;
-    ioctl(STDIN_FILENO, TIOCGWINSZ, &winsize);
+    struct winsize winsize = {.ws_row = (unsigned short)height, .ws_col = (unsigned short)width};
+    drawing = bb;
     int onscreen = winsize.ws_row - 3;
 
-    bb->dirty |= (winsize.ws_row != oldsize.ws_row) || (winsize.ws_col != oldsize.ws_col);
+    bb->dirty |= (winsize.ws_row != oldsize.ws_row) || (winsize.ws_col != oldsize.ws_col) || !rows;
     oldsize = winsize;
+    if (onscreen < 1) onscreen = 1;
+    if (bb->dirty) {
+        rows = grow(rows, (size_t)onscreen);
+        memset(rows, 0, sizeof(drawn_row_t) * (size_t)onscreen);
+    }
+    if (!rowfile) rowfile = nonnull(open_memstream(&rowbuf, &rowsize));
 
-    if (!bb->dirty) {
+    if (!bb->dirty && bb->listing_changed) {
+        move_rows(out, bb, rows, onscreen, winsize.ws_row);
+    } else if (!bb->dirty) {
         // Use terminal scrolling:
         if (lastscroll > bb->scroll) {
             fprintf(out, "\033[3;%dr\033[%dT\033[1;%dr", winsize.ws_row - 1, lastscroll - bb->scroll, winsize.ws_row);
         } else if (lastscroll < bb->scroll) {
             fprintf(out, "\033[3;%dr\033[%dS\033[1;%dr", winsize.ws_row - 1, bb->scroll - lastscroll, winsize.ws_row);
         }
+        int delta = MAX(-onscreen, MIN(bb->scroll - lastscroll, onscreen));
+        if (delta > 0) {
+            memmove(&rows[0], &rows[delta], sizeof(drawn_row_t) * (size_t)(onscreen - delta));
+            memset(&rows[onscreen - delta], 0, sizeof(drawn_row_t) * (size_t)delta);
+        } else if (delta < 0) {
+            memmove(&rows[-delta], &rows[0], sizeof(drawn_row_t) * (size_t)(onscreen + delta));
+            memset(&rows[0], 0, sizeof(drawn_row_t) * (size_t)-delta);
+        }
     }
 
     if (bb->dirty) {
@@ -292,7 +607,9 @@ void render(FILE *out, bb_t *bb) {
         fputs(color, out);
 
         char *home = getenv("HOME");
-        if (home && strncmp(bb->path, home, strlen(home)) == 0) {
+        if (bb->viewing_selection) {
+            fputs("Selected files", out);
+        } else if (home && strncmp(bb->path, home, strlen(home)) == 0) {
             fputs("~", out);
             fputs_escaped(out, bb->path + strlen(home), color);
         } else {
@@ -315,26 +632,34 @@ void render(FILE *out, bb_t *bb) {
     if (bb->nfiles == 0) {
         move_cursor(out, 0, 2);
         fputs("\033[37;2m ...no files here... \033[0m\033[J", out);
+        memset(rows, 0, sizeof(drawn_row_t) * (size_t)onscreen);
     } else {
-        entry_t **files = bb->files;
         for (int i = bb->scroll; i < bb->scroll + onscreen && i < bb->nfiles; i++) {
-            if (!(bb->dirty || i == bb->cursor || i == lastcursor || i < lastscroll || i >= lastscroll + onscreen)) {
+            if (!(bb->dirty || bb->listing_changed || i == bb->cursor || i == lastcursor || i < lastscroll
+                  || i >= lastscroll + onscreen)) {
                 continue;
             }
 
-            entry_t *entry = files[i];
-            const char *color = NORMAL_COLOR;
-            if (i == bb->cursor) color = CURSOR_COLOR;
-            else if (S_ISDIR(entry->info.st_mode)) color = DIR_COLOR;
-            else if (S_ISLNK(entry->info.st_mode)) color = LINK_COLOR;
-            else if (entry->info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) color = EXECUTABLE_COLOR;
-
-            int x = 0, y = i - bb->scroll + 2;
-            move_cursor(out, x, y);
-            draw_row(out, bb->columns, entry, color, winsize.ws_col - 1);
+            entry_t *entry = FILE_AT(bb, i);
+            const char *color = i == bb->cursor ? CURSOR_COLOR : entry_color(entry);
+
+            // The row is drawn to a buffer first, so it can be skipped if
+            // it's already on the screen:
+            rewind(rowfile);
+            draw_row(rowfile, bb->columns, entry, color, winsize.ws_col - 1);
+            fflush(rowfile);
+            size_t len = (size_t)ftell(rowfile);
+            drawn_row_t row = {hash_row(entry->fullname, strlen(entry->fullname)), hash_row(rowbuf, len)};
+            int y = i - bb->scroll;
+            if (rows[y].id == row.id && rows[y].text == row.text) continue;
+            rows[y] = row;
+            move_cursor(out, 0, y + 2);
+            fwrite(rowbuf, 1, len, out);
         }
-        move_cursor(out, 0, MIN(bb->nfiles - bb->scroll, onscreen) + 2);
+        int nshown = MIN(bb->nfiles - bb->scroll, onscreen);
+        move_cursor(out, 0, nshown + 2);
         fputs("\033[J", out);
+        memset(&rows[nshown], 0, sizeof(drawn_row_t) * (size_t)(onscreen - nshown));
     }
 
     // Scrollbar:
@@ -351,10 +676,23 @@ void render(FILE *out, bb_t *bb) {
     move_cursor(out, winsize.ws_col / 2, winsize.ws_row - 1);
     fputs("\033[0m\033[K", out);
     int x = winsize.ws_col;
-    if (bb->selected) { // Number of selected files
-        int n = 0;
-        for (entry_t *s = bb->selected; s; s = s->selected.next)
-            ++n;
+    int warning_x = 0; // The warning goes after the rename prompt (if there is one)
+    if (bb->renaming) { // The pattern and replacement being typed
+        const rename_t *r = bb->renaming;
+        char status[sizeof(r->error) + 32];
+        if (r->error[0]) sprintf(status, "(%s)", r->error);
+        else if (r->nconflicts > 0) sprintf(status, "(%d conflicts)", r->nconflicts);
+        else sprintf(status, "(%d renamed)", r->nrenamed);
+        move_cursor(out, 0, winsize.ws_row - 1);
+        fputs("\033[K", out);
+        fprintf(out, "\033[1m Rename:\033[0m /%s%s\033[0m/ → %s%s\033[0m %s%s\033[0m", r->field == 0 ? "\033[4m" : "",
+                r->fields[0], r->field == 1 ? "\033[4m" : "", r->fields[1],
+                r->error[0] || r->nconflicts > 0 ? "\033[31m" : "\033[2m", status);
+        warning_x = text_width(" Rename: // →  ") + text_width(r->fields[0]) + text_width(r->fields[1])
+                    + text_width(status) + 1;
+    }
+    if (bb->nselected + bb->nselected_paths + bb->selection.count > 0) { // Number of selected files
+        int n = bb->nselected + bb->nselected_paths + bb->selection.count;
         x -= 14;
         for (int k = n; k; k /= 10)
             x--;
@@ -371,10 +709,24 @@ void render(FILE *out, bb_t *bb) {
         move_cursor(out, MAX(0, x), winsize.ws_row - 1);
         fprintf(out, "\033[44;30m %d Suspended \033[0m", nprocs);
     }
+    if (bb->warnings[0].count > 0) { // Most recent warning (and how many others)
+        char buf[sizeof(bb->warnings[0].message) + 64];
+        int len = sprintf(buf, " %s", bb->warnings[0].message);
+        if (bb->warnings[0].count > 1) len += sprintf(buf + len, " (x%d)", bb->warnings[0].count);
+        int nmore = 0;
+        for (int i = 1; i < MAX_WARNINGS; i++)
+            if (bb->warnings[i].count > 0) ++nmore;
+        if (nmore > 0) len += sprintf(buf + len, " (+%d more)", nmore);
+        if (x - warning_x - 2 > 0) {
+            move_cursor(out, warning_x, winsize.ws_row - 1);
+            fprintf(out, "\033[41;33;1m%.*s \033[0m", MIN(len, x - warning_x - 2), buf);
+        }
+    }
     move_cursor(out, winsize.ws_col / 2, winsize.ws_row - 1);
 
     lastcursor = bb->cursor;
     lastscroll = bb->scroll;
+    bb->listing_changed = 0;
     fflush(out);
     bb->dirty = 0;
 }
@@ -20,6 +20,8 @@
 #define LINK_COLOR "\033[35m"
 #define DIR_COLOR "\033[34m"
 #define EXECUTABLE_COLOR "\033[31m"
+#define RENAME_COLOR "\033[32m"
+#define RENAME_CONFLICT_COLOR "\033[31;1m"
 #define SCROLLBAR_FG "\033[48;5;247m "
 #define SCROLLBAR_BG "\033[48;5;239m "
 
@@ -29,9 +31,29 @@
 #define SORT_INDICATOR "↓"
 #define RSORT_INDICATOR "↑"
 
+// Information about files that columns (or sort keys) need besides what's
+// loaded with the listing, which is only looked up when they're used. Every
+// file's lstat() info and link target are always loaded, since they're needed
+// to color the listing and to put directories first, whatever the columns are:
+#define COLUMN_NEEDS_XATTRS 1 // See xattrs.c
+#define COLUMN_NEEDS_OWNERS 2 // See owners.c
+
+// How long what a column shows, and the order it sorts files in, stay the same
+// (as long as the files don't change):
+typedef enum {
+    COLUMN_STABLE = 0, // For good
+    COLUMN_CLOCK,      // What's shown changes as time passes (e.g. "5 minutes"), but not the order
+    COLUMN_VOLATILE,   // Until bb's state changes or background lookups finish, so orders can't be reused
+} column_cache_e;
+
 typedef struct {
     const char *name;
     void (*render)(entry_t *, const char *, char *, int);
+    // How files are ordered by this column (NULL if they can't be): negative if
+    // e1 comes first when sorting with '+', positive if e2 does, or 0 for a tie.
+    int (*compare)(const bb_t *bb, entry_t *e1, entry_t *e2);
+    unsigned int needs;
+    column_cache_e cache;
     unsigned int stretchy : 1;
 } column_t;
 
@@ -45,12 +67,21 @@ typedef enum {
     COL_ATIME = 'a',
     COL_RANDOM = 'r',
     COL_SELECTED = '*',
+    COL_XATTRS = 'x',
+    COL_OWNER = 'u',
+    COL_GROUP = 'g',
+    COL_LINKS = 'l',
+    COL_INODE = 'i',
 } column_e;
 
+extern column_t column_info[255];
+
+unsigned int columns_needs(const char *keys);
+int columns_have_cache(const char *keys, column_cache_e cache);
 void draw_column_labels(FILE *out, char columns[], char *sort, int width);
 void draw_row(FILE *out, char columns[], entry_t *entry, const char *color, int width);
 int *get_column_widths(char columns[], int width);
-void render(FILE *out, bb_t *bb);
+void render(FILE *out, bb_t *bb, int width, int height);
 
 void col_mreltime(entry_t *entry, const char *color, char *buf, int width);
 void col_areltime(entry_t *entry, const char *color, char *buf, int width);
@@ -59,10 +90,29 @@ void col_mtime(entry_t *entry, const char *color, char *buf, int width);
 void col_atime(entry_t *entry, const char *color, char *buf, int width);
 void col_ctime(entry_t *entry, const char *color, char *buf, int width);
 void col_selected(entry_t *entry, const char *color, char *buf, int width);
+void col_group(entry_t *entry, const char *color, char *buf, int width);
+void col_inode(entry_t *entry, const char *color, char *buf, int width);
+void col_links(entry_t *entry, const char *color, char *buf, int width);
+void col_owner(entry_t *entry, const char *color, char *buf, int width);
 void col_perm(entry_t *entry, const char *color, char *buf, int width);
 void col_random(entry_t *entry, const char *color, char *buf, int width);
 void col_size(entry_t *entry, const char *color, char *buf, int width);
 void col_name(entry_t *entry, const char *color, char *buf, int width);
+void col_xattrs(entry_t *entry, const char *color, char *buf, int width);
+
+int cmp_atime(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_ctime(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_group(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_inode(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_links(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_mtime(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_name(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_owner(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_perm(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_random(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_selected(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_size(const bb_t *bb, entry_t *e1, entry_t *e2);
+int cmp_xattrs(const bb_t *bb, entry_t *e1, entry_t *e2);
 
 #endif
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,132 @@
+//
+// latency.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of measuring key press latency. Each
+// kind of key press has a histogram of latencies in microseconds, with buckets
+// that are exact for small values and then split each power of two into
+// LATENCY_SUBBUCKETS equal parts (like HdrHistogram), so percentiles are
+// accurate to within a few percent with a small, fixed amount of memory.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define LATENCY_SUBBUCKET_BITS 4
+#define LATENCY_SUBBUCKETS (1 << LATENCY_SUBBUCKET_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUBBUCKETS * (64 - LATENCY_SUBBUCKET_BITS + 1))
+
+typedef struct {
+    uint32_t counts[LATENCY_BUCKETS];
+    uint64_t total, max;
+} histogram_t;
+
+static histogram_t histograms[NUM_LATENCY_KINDS];
+static const char *kind_names[NUM_LATENCY_KINDS] = {
+    [LATENCY_BBCMD] = "bbcmd",
+    [LATENCY_SCRIPT] = "script",
+    [LATENCY_CD] = "cd",
+    [LATENCY_SORT] = "sort",
+};
+
+// The key press that hasn't been drawn yet (if any):
+static struct {
+    struct timespec pressed;
+    latency_kind_t kind;
+    int active;
+} pending = {0};
+
+//
+// Return the bucket for a number of microseconds.
+//
+static int bucket_of(uint64_t usec) {
+    if (usec < LATENCY_SUBBUCKETS) return (int)usec;
+    int magnitude = 63 - __builtin_clzll(usec) - LATENCY_SUBBUCKET_BITS; // >= 0
+    int sub = (int)(usec >> magnitude) - LATENCY_SUBBUCKETS;
+    return LATENCY_SUBBUCKETS * (magnitude + 1) + sub;
+}
+
+//
+// Return the largest number of microseconds that goes in a bucket.
+//
+static uint64_t bucket_max(int bucket) {
+    if (bucket < LATENCY_SUBBUCKETS) return (uint64_t)bucket;
+    int magnitude = bucket / LATENCY_SUBBUCKETS - 1;
+    uint64_t start = (uint64_t)(LATENCY_SUBBUCKETS + bucket % LATENCY_SUBBUCKETS) << magnitude;
+    return start + ((uint64_t)1 << magnitude) - 1;
+}
+
+//
+// Return the latency (in microseconds) that the given fraction of key presses
+// took no longer than.
+//
+static uint64_t percentile(const histogram_t *h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)h->total + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) return bucket_max(b) < h->max ? bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+//
+// Start measuring a key press (which was read at the time `pressed`), which
+// does the given kind of thing.
+//
+void latency_start(struct timespec pressed, latency_kind_t kind) {
+    pending.pressed = pressed;
+    pending.kind = kind;
+    pending.active = 1;
+}
+
+//
+// Note that the key press being measured turned out to do something more
+// specific (e.g. a key binding's bb command changed directory). Key presses
+// that run scripts are always counted as scripts.
+//
+void latency_refine(latency_kind_t kind) {
+    if (pending.active && pending.kind == LATENCY_BBCMD) pending.kind = kind;
+}
+
+//
+// Record how long it took for the key press being measured (if any) to be
+// drawn, now that it has been.
+//
+void latency_painted(void) {
+    if (!pending.active) return;
+    pending.active = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t usec = (int64_t)(now.tv_sec - pending.pressed.tv_sec) * 1000000
+                 + (now.tv_nsec - pending.pressed.tv_nsec) / 1000;
+    if (usec < 0) usec = 0;
+    histogram_t *h = &histograms[pending.kind];
+    ++h->counts[bucket_of((uint64_t)usec)];
+    ++h->total;
+    if ((uint64_t)usec > h->max) h->max = (uint64_t)usec;
+}
+
+//
+// Print the number of key presses of each kind and their median, 99th
+// percentile and maximum latencies.
+//
+void latency_print_report(FILE *out) {
+    fprintf(out, "%-8s %8s %10s %10s %10s\n", "Kind", "Count", "p50", "p99", "Max");
+    for (int k = 0; k < NUM_LATENCY_KINDS; k++) {
+        const histogram_t *h = &histograms[k];
+        if (h->total == 0) {
+            fprintf(out, "%-8s %8d %10s %10s %10s\n", kind_names[k], 0, "-", "-", "-");
+            continue;
+        }
+        fprintf(out, "%-8s %8llu %8.2fms %8.2fms %8.2fms\n", kind_names[k], (unsigned long long)h->total,
+                (double)percentile(h, 0.50) / 1000.0, (double)percentile(h, 0.99) / 1000.0,
+                (double)h->max / 1000.0);
+    }
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,32 @@
+//
+// latency.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for measuring how long it takes from a key
+// being pressed until the result has been drawn, which is kept in histograms
+// for each kind of thing a key can do.
+//
+
+#ifndef FILE_LATENCY__H
+#define FILE_LATENCY__H
+
+#include <stdio.h>
+#include <time.h>
+
+// The kinds of things a key press can do, which are measured separately:
+typedef enum {
+    LATENCY_BBCMD,  // A key binding that only runs bb commands
+    LATENCY_SCRIPT, // A key binding that runs a shell script
+    LATENCY_CD,     // A bb command that changes directory
+    LATENCY_SORT,   // A bb command that changes the sort order
+    NUM_LATENCY_KINDS,
+} latency_kind_t;
+
+void latency_start(struct timespec pressed, latency_kind_t kind);
+void latency_refine(latency_kind_t kind);
+void latency_painted(void);
+void latency_print_report(FILE *out);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,187 @@
+//
+// links.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of bb's symbolic link target cache.
+// Link targets are only stat()ed when something needs to know what kind of
+// file a link points to, and the results are shared between all links that
+// point to the same target until another directory is loaded, when they're
+// looked up again the next time they're needed.
+//
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "links.h"
+#include "mem.h"
+#include "utils.h"
+
+#define LINK_HASH_SIZE 4096
+#define LINK_HASH_MASK (LINK_HASH_SIZE - 1)
+
+typedef struct target_s {
+    struct target_s *next;
+    mode_t mode;
+    unsigned int generation;
+    char path[1];
+    // ------- path must be last! --------------
+} target_t;
+
+static size_t reclaim_targets(size_t want);
+
+static target_t *targets[LINK_HASH_SIZE] = {0};
+static unsigned int generation = 0;
+static mempool_t target_pool = {.name = "Symlink targets", .reclaim = reclaim_targets};
+// The directory of the last link that was looked up, and its real path (if
+// it's been resolved since the current directory was loaded):
+static char link_dir[PATH_MAX] = {0}, real_dir[PATH_MAX] = {0};
+static int have_real_dir = 0;
+
+//
+// Store the path that a link in the directory `dir` (the first `dirlen` bytes,
+// which must be a real path) with the given link name points to in
+// `target`. Repeated slashes and "." are left out and ".." is applied, so
+// links that point to the same file in different ways share a cached target.
+// A ".." after a component of the link name itself is kept, because that
+// component could be a link too.
+//
+static void join_target(const char *dir, size_t dirlen, const char *linkname, char *target) {
+    size_t len = 0;
+    if (linkname[0] != '/') {
+        memcpy(target, dir, dirlen);
+        len = dirlen;
+    }
+    int resolved = 1; // Whether `target` has no components from the link name yet
+    for (const char *p = linkname; *p;) {
+        while (*p == '/')
+            ++p;
+        size_t n = strcspn(p, "/");
+        if (n == 0) {
+            break;
+        } else if (n == 2 && p[0] == '.' && p[1] == '.' && resolved) {
+            while (len > 0 && target[len - 1] != '/')
+                --len;
+            if (len > 0) --len;
+        } else if (n != 1 || p[0] != '.') {
+            target[len++] = '/';
+            memcpy(&target[len], p, n);
+            len += n;
+            resolved = 0;
+        }
+        p += n;
+    }
+    if (len == 0) target[len++] = '/';
+    target[len] = '\0';
+}
+
+static size_t target_size(target_t *t) { return sizeof(target_t) + strlen(t->path); }
+
+//
+// Free cached targets (ones that haven't been used since the current
+// directory was loaded go first) until `want` bytes have been freed.
+//
+static size_t reclaim_targets(size_t want) {
+    size_t freed = 0;
+    for (int cold_only = 1; cold_only >= 0 && freed < want; cold_only--) {
+        for (int i = 0; i < LINK_HASH_SIZE && freed < want; i++) {
+            for (target_t **t = &targets[i]; *t && freed < want;) {
+                if (cold_only && (*t)->generation == generation) {
+                    t = &(*t)->next;
+                    continue;
+                }
+                target_t *dead = *t;
+                *t = dead->next;
+                freed += target_size(dead);
+                delete (&dead);
+            }
+        }
+    }
+    mem_release(&target_pool, freed);
+    return freed;
+}
+
+//
+// Return the st_mode of the file a symbolic link entry points to (or 0 if the
+// link is broken), stat()ing the target only if it hasn't already been looked
+// up since the current directory was loaded.
+//
+mode_t entry_linkedmode(entry_t *e) {
+    if (e->link_resolved || !e->linkname) return e->linkedmode;
+    e->link_resolved = 1;
+
+    struct stat linkedstat;
+    char target[PATH_MAX * 2];
+    if (e->linkname[0] == '/') {
+        join_target("", 0, e->linkname, target);
+    } else {
+        // Entries that weren't loaded from a listing (e.g. with `select:`) can
+        // have links in their directory, so it's resolved first:
+        const char *slash = strrchr(e->fullname, '/');
+        int dirlen = slash ? (int)(slash - e->fullname) : 0;
+        if (!have_real_dir || strncmp(link_dir, e->fullname, (size_t)dirlen) != 0 || link_dir[dirlen]) {
+            snprintf(link_dir, sizeof(link_dir), "%.*s", dirlen, e->fullname);
+            have_real_dir = realpath(dirlen > 0 ? link_dir : "/", real_dir) != NULL;
+        }
+        if (!have_real_dir) { // Looked up without the cache
+            sprintf(target, "%.*s/%s", dirlen, e->fullname, e->linkname);
+            return e->linkedmode = stat(target, &linkedstat) == 0 ? linkedstat.st_mode : 0;
+        }
+        join_target(real_dir, streq(real_dir, "/") ? 0 : strlen(real_dir), e->linkname, target);
+    }
+
+    unsigned int h = (unsigned int)hash_bytes(target, strlen(target)) & LINK_HASH_MASK;
+    for (target_t *t = targets[h]; t; t = t->next) {
+        if (!streq(t->path, target)) continue;
+        if (t->generation != generation) { // The target may have changed since it was looked up
+            t->mode = stat(target, &linkedstat) == 0 ? linkedstat.st_mode : 0;
+            t->generation = generation;
+        }
+        return e->linkedmode = t->mode;
+    }
+
+    e->linkedmode = stat(target, &linkedstat) == 0 ? linkedstat.st_mode : 0;
+
+    size_t size = sizeof(target_t) + strlen(target);
+    if (mem_can_grow(size)) {
+        target_t *t = new_bytes(size);
+        strcpy(t->path, target);
+        t->mode = e->linkedmode;
+        t->generation = generation;
+        t->next = targets[h];
+        targets[h] = t;
+        mem_charge(&target_pool, size);
+    }
+    return e->linkedmode;
+}
+
+void links_init(void) { mem_register(&target_pool); }
+
+//
+// Mark the start of a new directory listing. Targets are looked up again the
+// next time they're needed, and the ones that aren't needed are the first to
+// be evicted.
+//
+void links_new_generation(void) {
+    ++generation;
+    have_real_dir = 0;
+}
+
+//
+// Forget all cached link targets (e.g. when the user asks for a refresh)
+//
+void links_forget(void) {
+    for (int i = 0; i < LINK_HASH_SIZE; i++) {
+        for (target_t *next, *t = targets[i]; t; t = next) {
+            next = t->next;
+            delete (&t);
+        }
+        targets[i] = NULL;
+    }
+    mem_release(&target_pool, target_pool.used);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
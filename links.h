@@ -0,0 +1,26 @@
+//
+// links.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for resolving symbolic link targets, which
+// is done lazily and cached, since many links often point to the same targets.
+//
+
+#ifndef FILE_LINKS__H
+#define FILE_LINKS__H
+
+#include <sys/stat.h>
+
+#include "types.h"
+
+// Whether an entry is a directory or a symbolic link to a directory:
+#define E_ISDIR(e) (S_ISDIR(S_ISLNK((e)->info.st_mode) ? entry_linkedmode(e) : (e)->info.st_mode))
+
+mode_t entry_linkedmode(entry_t *e);
+void links_init(void);
+void links_new_generation(void);
+void links_forget(void);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
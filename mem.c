@@ -0,0 +1,243 @@
+//
+// mem.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of bb's memory accounting. Every pool
+// of memory (file entries, caches) is charged here, so bb can tell how much
+// it's using, refuse to grow caches past the memory budget, and evict cold
+// cache data when the kernel reports memory pressure.
+//
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+// Linux pressure stall trigger: notify when tasks are stalled on memory for
+// 150ms in any 2s window (2s is the smallest window unprivileged users may use)
+#define PSI_TRIGGER "some 150000 2000000"
+
+static mempool_t *pools = NULL;
+static size_t budget = DEFAULT_MEMORY_BUDGET;
+static int pressure_fd = -1;
+static const char *pressure_source = NULL;
+static int pressure_events = 0;
+
+//
+// Register a memory pool so that its usage is counted and its data can be
+// reclaimed. Registering a pool more than once has no effect.
+//
+void mem_register(mempool_t *pool) {
+    for (mempool_t *p = pools; p; p = p->next)
+        if (p == pool) return;
+    pool->next = pools;
+    pools = pool;
+}
+
+//
+// Record that a pool has allocated `bytes` more memory.
+//
+void mem_charge(mempool_t *pool, size_t bytes) {
+    pool->used += bytes;
+    if (pool->used > pool->peak) pool->peak = pool->used;
+}
+
+//
+// Record that a pool has freed `bytes` of memory.
+//
+void mem_release(mempool_t *pool, size_t bytes) { pool->used = bytes > pool->used ? 0 : pool->used - bytes; }
+
+//
+// Return whether `bytes` more memory can be used without going over budget.
+// Caches should check this before adding data and skip caching if not.
+//
+int mem_can_grow(size_t bytes) { return mem_used() + bytes <= budget; }
+
+//
+// Return the total memory used by all pools.
+//
+size_t mem_used(void) {
+    size_t used = 0;
+    for (mempool_t *p = pools; p; p = p->next)
+        used += p->used;
+    return used;
+}
+
+//
+// Return the total memory used by pools that can be reclaimed.
+//
+static size_t mem_reclaimable(void) {
+    size_t used = 0;
+    for (mempool_t *p = pools; p; p = p->next)
+        if (p->reclaim) used += p->used;
+    return used;
+}
+
+//
+// Return how much more memory could be used without going over budget,
+// counting cache data that could be reclaimed as available.
+//
+size_t mem_available(void) {
+    size_t used = mem_used() - mem_reclaimable();
+    return used > budget ? 0 : budget - used;
+}
+
+size_t mem_budget(void) { return budget; }
+
+//
+// Set the memory budget and evict cache data until usage fits within it.
+//
+void mem_set_budget(size_t new_budget) {
+    budget = new_budget;
+    size_t used = mem_used();
+    if (used > budget) mem_reclaim(used - budget);
+}
+
+//
+// Ask the cache pools to free up to `want` bytes and return how much was freed.
+//
+size_t mem_reclaim(size_t want) {
+    size_t freed = 0;
+    for (mempool_t *p = pools; p && freed < want; p = p->next)
+        if (p->reclaim && p->used > 0) freed += p->reclaim(want - freed);
+    return freed;
+}
+
+#ifdef __linux__
+//
+// Open the memory.events file for the cgroup bb is running in (cgroup v2 only).
+//
+static int open_cgroup_events(void) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return -1;
+    char *line = NULL;
+    size_t space = 0;
+    int fd = -1;
+    while (getline(&line, &space, f) >= 0) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        char path[4096];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.events", line + 3);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        break;
+    }
+    free(line);
+    fclose(f);
+    return fd;
+}
+#endif
+
+//
+// Subscribe to memory pressure notifications from the kernel, using pressure
+// stall information if available and cgroup memory events otherwise.
+// Return a file descriptor that becomes readable (POLLPRI) under memory pressure,
+// or -1 if neither is supported.
+//
+int mem_watch_pressure(void) {
+    if (pressure_fd >= 0) return pressure_fd;
+#ifdef __linux__
+    int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0) {
+        if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+            close(fd);
+            fd = -1;
+        } else {
+            pressure_source = "pressure stall information";
+        }
+    }
+    if (fd < 0 && (fd = open_cgroup_events()) >= 0) {
+        char buf[512];
+        (void)read(fd, buf, sizeof(buf)); // Reading arms the notification
+        pressure_source = "cgroup memory events";
+    }
+    pressure_fd = fd;
+#endif
+    return pressure_fd;
+}
+
+//
+// Check (without blocking) whether the kernel has reported memory pressure,
+// and if so, evict half of the reclaimable cache data. Return 1 if there was
+// memory pressure, otherwise 0.
+//
+int mem_check_pressure(void) {
+    if (pressure_fd < 0) return 0;
+    struct pollfd pfd = {.fd = pressure_fd, .events = POLLPRI};
+    if (poll(&pfd, 1, 0) <= 0) return 0;
+    if (!(pfd.revents & POLLPRI)) { // The monitor went away
+        close(pressure_fd);
+        pressure_fd = -1;
+        return 0;
+    }
+    if (lseek(pressure_fd, 0, SEEK_SET) == 0) {
+        char buf[512];
+        (void)read(pressure_fd, buf, sizeof(buf));
+    }
+    ++pressure_events;
+    mem_reclaim(mem_reclaimable() / 2);
+    return 1;
+}
+
+//
+// Parse a size like "512K", "64M", or "1G" and return the number of bytes
+// (or 0 if the size is invalid).
+//
+size_t mem_parse_size(const char *str) {
+    if (!str || !isdigit(*str)) return 0;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 10);
+    int shift = 0;
+    switch (toupper(*end)) {
+    case 'G': shift += 10; // fallthrough
+    case 'M': shift += 10; // fallthrough
+    case 'K': shift += 10; ++end; break;
+    case '\0': break;
+    default: return 0;
+    }
+    if (toupper(*end) == 'B') ++end;
+    if (*end || errno == ERANGE || n > (SIZE_MAX >> shift)) return 0; // Sizes that overflow are invalid
+    return (size_t)n << shift;
+}
+
+//
+// Write a human-readable size into `buf`
+//
+static const char *fmt_size(char *buf, size_t bytes) {
+    const char *units = "BKMGT";
+    double n = (double)bytes;
+    int mag = 0;
+    while (n >= 1024 && units[mag + 1]) {
+        n /= 1024;
+        ++mag;
+    }
+    sprintf(buf, mag ? "%.1f%c" : "%.0f%c", n, units[mag]);
+    return buf;
+}
+
+//
+// Print a report of memory usage by pool.
+//
+void mem_print_report(FILE *out) {
+    char used[32], peak[32];
+    fprintf(out, "\033[1m%-24s %10s %10s\033[0m\n", "Pool", "Used", "Peak");
+    for (mempool_t *p = pools; p; p = p->next)
+        fprintf(out, "%-24s %10s %10s%s\n", p->name, fmt_size(used, p->used), fmt_size(peak, p->peak),
+                p->reclaim ? "" : " (not reclaimable)");
+    fprintf(out, "\033[1m%-24s %10s\033[0m\n", "Total", fmt_size(used, mem_used()));
+    fprintf(out, "%-24s %10s\n", "Budget", fmt_size(used, budget));
+    if (pressure_fd >= 0)
+        fprintf(out, "\nWatching %s: %d pressure event%s\n", pressure_source, pressure_events,
+                pressure_events == 1 ? "" : "s");
+    else fprintf(out, "\nNot watching for memory pressure (unsupported)\n");
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,48 @@
+//
+// mem.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for bb's memory accounting, which keeps
+// track of how much memory entries and caches are using and evicts cold
+// cache data when bb is over its memory budget or the system is under memory
+// pressure.
+//
+
+#ifndef FILE_MEM__H
+#define FILE_MEM__H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define DEFAULT_MEMORY_BUDGET ((size_t)256 << 20)
+
+//
+// A pool of memory that is accounted against bb's memory budget. Pools that
+// hold data which can be recomputed (caches) provide a `reclaim` callback,
+// which should free up to `want` bytes, coldest data first, and return the
+// number of bytes actually freed.
+//
+typedef struct mempool_s {
+    const char *name;
+    size_t used, peak;
+    size_t (*reclaim)(size_t want);
+    struct mempool_s *next;
+} mempool_t;
+
+void mem_register(mempool_t *pool);
+void mem_charge(mempool_t *pool, size_t bytes);
+void mem_release(mempool_t *pool, size_t bytes);
+int mem_can_grow(size_t bytes);
+size_t mem_used(void);
+size_t mem_available(void);
+size_t mem_budget(void);
+void mem_set_budget(size_t budget);
+size_t mem_reclaim(size_t want);
+int mem_watch_pressure(void);
+int mem_check_pressure(void);
+size_t mem_parse_size(const char *str);
+void mem_print_report(FILE *out);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,282 @@
+//
+// owners.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of bb's user and group name cache.
+// Looking up a name can mean a round trip to a directory server (e.g. with
+// LDAP), so it's done by a worker process, which is sent IDs over a socket
+// and replies with each name (or an empty string if the ID has no name), in
+// order. Until a name comes in, the ID is used instead. Names (and IDs
+// without names) are looked up again after a while, and in the meantime, the
+// old name is still used.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "owners.h"
+#include "utils.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define OWNER_HASH_SIZE 256
+#define OWNER_HASH_MASK (OWNER_HASH_SIZE - 1)
+// How long (in seconds) a name, or the lack of one, is used before it's looked up again:
+#define OWNER_TTL 600
+#define OWNER_MISSING_TTL 60
+// The size of a request: the kind of ID, then the ID
+#define OWNER_REQUEST_SIZE 8
+
+typedef struct owner_s {
+    struct owner_s *next;
+    char *name; // NULL if the ID has no name (or it hasn't been looked up)
+    time_t expires;
+    unsigned int id;
+    char kind;
+    unsigned int pending : 1;
+} owner_t;
+
+static owner_t *owners[OWNER_HASH_SIZE] = {0};
+static pid_t worker_pid = 0;
+static int worker_fd = -1;
+// Requests that haven't been written to the socket yet, and replies that
+// haven't been read completely:
+static char *out = NULL, *in = NULL;
+static size_t outlen = 0, outsize = 0, inlen = 0, insize = 0;
+// The IDs that are waiting for replies, oldest first:
+static owner_t **inflight = NULL;
+static int inflight_first = 0, inflight_count = 0, inflight_size = 0;
+
+//
+// The main loop of the worker process: read requests and reply with the
+// names, until bb closes the socket.
+//
+static void run_worker(int fd) {
+    int signals[] = {SIGTERM, SIGINT, SIGXCPU, SIGXFSZ, SIGVTALRM, SIGPROF, SIGSEGV, SIGTSTP, SIGWINCH};
+    for (size_t i = 0; i < LEN(signals); i++)
+        signal(signals[i], SIG_DFL);
+    FILE *requests = fdopen(fd, "r");
+    if (!requests) _exit(EXIT_FAILURE);
+    char request[OWNER_REQUEST_SIZE];
+    while (fread(request, sizeof(request), 1, requests) == 1) {
+        unsigned int id;
+        memcpy(&id, &request[4], sizeof(id));
+        const char *name = NULL;
+        if (request[0] == OWNER_USER) {
+            struct passwd *pw = getpwuid((uid_t)id);
+            if (pw) name = pw->pw_name;
+        } else {
+            struct group *gr = getgrgid((gid_t)id);
+            if (gr) name = gr->gr_name;
+        }
+        if (!name) name = "";
+        size_t len = strlen(name) + 1;
+        for (size_t written = 0; written < len;) {
+            ssize_t n = write(fd, name + written, len - written);
+            if (n < 0 && errno != EINTR) _exit(EXIT_FAILURE);
+            if (n > 0) written += (size_t)n;
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+//
+// Start the worker process, and return 0 if it started.
+//
+static int start_worker(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return -1;
+    if ((worker_pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (worker_pid == 0) {
+        close(fds[0]);
+        run_worker(fds[1]);
+    }
+    close(fds[1]);
+    worker_fd = fds[0];
+    (void)fcntl(worker_fd, F_SETFD, FD_CLOEXEC); // Scripts don't need it
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    (void)setsockopt(worker_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return 0;
+}
+
+//
+// Stop the worker process. The IDs it hadn't replied to keep their old
+// names for now, and are looked up again later.
+//
+static void stop_worker(void) {
+    close(worker_fd);
+    kill(worker_pid, SIGTERM);
+    waitpid(worker_pid, NULL, 0);
+    worker_pid = 0;
+    worker_fd = -1;
+    for (; inflight_count > 0; inflight_count--) {
+        owner_t *o = inflight[inflight_first++];
+        o->pending = 0;
+        o->expires = time(NULL) + OWNER_MISSING_TTL;
+    }
+    inflight_first = 0;
+    outlen = inlen = 0;
+}
+
+//
+// Write as much of the requests to the worker as can be written without
+// waiting.
+//
+static void send_requests(void) {
+    if (worker_pid <= 0 || outlen == 0) return;
+    ssize_t sent = send(worker_fd, out, outlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent <= 0) return; // If the worker died, it's noticed when its replies are read
+    memmove(out, out + sent, outlen - (size_t)sent);
+    outlen -= (size_t)sent;
+}
+
+//
+// Ask the worker for the name of an ID, and return 0 if it was asked.
+//
+static int request_name(owner_t *o) {
+    if (worker_pid <= 0 && start_worker() != 0) return -1;
+    if (outlen + OWNER_REQUEST_SIZE > outsize) {
+        outsize = MAX(2 * outsize, 256);
+        out = grow(out, outsize);
+    }
+    char *request = out + outlen;
+    memset(request, 0, OWNER_REQUEST_SIZE);
+    request[0] = o->kind;
+    memcpy(&request[4], &o->id, sizeof(o->id));
+    outlen += OWNER_REQUEST_SIZE;
+
+    if (inflight_first + inflight_count == inflight_size) {
+        if (inflight_first > 0) {
+            memmove(inflight, inflight + inflight_first, sizeof(owner_t *) * (size_t)inflight_count);
+            inflight_first = 0;
+        } else {
+            inflight_size = MAX(2 * inflight_size, 64);
+            inflight = grow(inflight, (size_t)inflight_size);
+        }
+    }
+    inflight[inflight_first + inflight_count++] = o;
+    o->pending = 1;
+    send_requests();
+    return 0;
+}
+
+//
+// Return the name of a user or group ID, or NULL if it doesn't have one or
+// it hasn't been looked up yet. This never waits: the name is looked up in
+// the background if it isn't known (or is out of date).
+//
+const char *owners_name(char kind, unsigned int id) {
+    unsigned int h = (id * 2654435761u + (unsigned char)kind) & OWNER_HASH_MASK;
+    owner_t *o;
+    for (o = owners[h]; o; o = o->next)
+        if (o->id == id && o->kind == kind) break;
+    if (!o) {
+        o = new (owner_t);
+        o->id = id;
+        o->kind = kind;
+        o->next = owners[h];
+        owners[h] = o;
+    }
+    if (!o->pending && o->expires <= time(NULL) && request_name(o) != 0)
+        o->expires = time(NULL) + OWNER_MISSING_TTL;
+    return o->name;
+}
+
+//
+// Compare two IDs by name, with IDs that don't have names (yet) after the
+// ones that do, in order of ID.
+//
+int owners_compare(char kind, unsigned int id1, unsigned int id2) {
+    if (id1 == id2) return 0;
+    const char *name1 = owners_name(kind, id1), *name2 = owners_name(kind, id2);
+    if (!name1 != !name2) return name1 ? -1 : 1;
+    int cmp = name1 ? strcmp(name1, name2) : 0;
+    return cmp ? cmp : (id1 < id2 ? -1 : 1);
+}
+
+//
+// Read the names the worker has sent back and send it any requests that
+// haven't been sent yet, without waiting for anything. Return how many
+// names came in.
+//
+int owners_update(void) {
+    if (worker_pid <= 0) return 0;
+    send_requests();
+    if (inflight_count == 0) return 0;
+    if (inlen + 4096 > insize) {
+        insize = inlen + 4096;
+        in = grow(in, insize);
+    }
+    ssize_t n = recv(worker_fd, in + inlen, insize - inlen, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        int finished = inflight_count;
+        stop_worker();
+        return finished;
+    } else if (n < 0) {
+        return 0;
+    }
+    inlen += (size_t)n;
+
+    int finished = 0;
+    char *reply = in, *end;
+    while (inflight_count > 0 && (end = memchr(reply, '\0', (size_t)(in + inlen - reply)))) {
+        owner_t *o = inflight[inflight_first++];
+        --inflight_count;
+        delete (&o->name);
+        if (*reply) o->name = check_strdup(reply);
+        o->expires = time(NULL) + (o->name ? OWNER_TTL : OWNER_MISSING_TTL);
+        o->pending = 0;
+        ++finished;
+        reply = end + 1;
+    }
+    inlen -= (size_t)(reply - in);
+    memmove(in, reply, inlen);
+    if (inflight_count == 0) inflight_first = 0;
+    return finished;
+}
+
+//
+// Return how many names haven't come in yet.
+//
+int owners_backlog(void) { return inflight_count; }
+
+//
+// Stop the worker and forget all the names.
+//
+void owners_stop(void) {
+    if (worker_pid > 0) stop_worker();
+    delete (&out);
+    delete (&in);
+    delete (&inflight);
+    outsize = insize = 0;
+    inflight_size = 0;
+    for (int i = 0; i < OWNER_HASH_SIZE; i++) {
+        for (owner_t *next, *o = owners[i]; o; o = next) {
+            next = o->next;
+            delete (&o->name);
+            delete (&o);
+        }
+        owners[i] = NULL;
+    }
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,25 @@
+//
+// owners.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for looking up the names of users and
+// groups, which is done by a background worker process (since it may need
+// to ask a directory server) and cached.
+//
+
+#ifndef FILE_OWNERS__H
+#define FILE_OWNERS__H
+
+// The kinds of IDs that have names:
+#define OWNER_USER 'u'
+#define OWNER_GROUP 'g'
+
+const char *owners_name(char kind, unsigned int id);
+int owners_compare(char kind, unsigned int id1, unsigned int id2);
+int owners_update(void);
+int owners_backlog(void);
+void owners_stop(void);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,253 @@
+//
+// rename.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of renaming the selected files with a
+// pattern. Every time the pattern changes, it's compiled once and applied to
+// the name of each selected file, and the new paths are checked for conflicts
+// with a hash set of all the old and new paths. The renames are only done
+// when they're committed, as a batch, one directory at a time.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rename.h"
+#include "terminal.h"
+#include "utils.h"
+
+// A path in the hash set of paths, and whose path it is:
+typedef struct {
+    const char *path;
+    int id, is_target;
+} path_slot_t;
+
+// A file being renamed, and where its entry is in the listing:
+typedef struct {
+    entry_t *entry;
+    int index;
+} renamed_file_t;
+
+//
+// Return the slot in a hash set (of `size` slots, a power of two) where a path
+// is, or where it would go.
+//
+static path_slot_t *find_path(path_slot_t *set, size_t size, const char *path) {
+    size_t i = hash_bytes(path, strlen(path)) & (size - 1);
+    while (set[i].path && !streq(set[i].path, path))
+        i = (i + 1) & (size - 1);
+    return &set[i];
+}
+
+//
+// Append `len` bytes of `str` to `buf` (which holds `*buflen` bytes and has
+// room for `size`), and return 0 if it doesn't fit.
+//
+static int append(char *buf, size_t *buflen, size_t size, const char *str, size_t len) {
+    if (*buflen + len + 1 > size) return 0;
+    memcpy(buf + *buflen, str, len);
+    buf[*buflen += len] = '\0';
+    return 1;
+}
+
+//
+// Replace the first match of `re` in `name` with `replacement`, where "\1"
+// through "\9" are replaced by the matched groups and "&" or "\0" by the whole
+// match, and store the result in `newname`. Return 0 if there's no match.
+//
+static int substitute(const regex_t *re, const char *name, const char *replacement, char *newname, size_t size) {
+    regmatch_t m[10];
+    if (regexec(re, name, 10, m, 0) != 0) return 0;
+    size_t len = 0;
+    newname[0] = '\0';
+    int ok = append(newname, &len, size, name, (size_t)m[0].rm_so);
+    for (const char *r = replacement; ok && *r; r++) {
+        int group = -1;
+        if (*r == '&') group = 0;
+        else if (r[0] == '\\' && '0' <= r[1] && r[1] <= '9') group = *(++r) - '0';
+        else if (r[0] == '\\' && r[1]) ++r;
+
+        if (group < 0) ok = append(newname, &len, size, r, 1);
+        else if (m[group].rm_so >= 0)
+            ok = append(newname, &len, size, name + m[group].rm_so, (size_t)(m[group].rm_eo - m[group].rm_so));
+    }
+    return ok && append(newname, &len, size, name + m[0].rm_eo, strlen(name + m[0].rm_eo));
+}
+
+//
+// Compare two of the files being renamed by path, so the files in each
+// directory are together.
+//
+static int compare_renamed_files(const void *v1, const void *v2) {
+    return compare_paths(((const renamed_file_t *)v1)->entry->fullname, ((const renamed_file_t *)v2)->entry->fullname);
+}
+
+//
+// Rename a file in a directory, unless there's already a file with the new
+// name.
+//
+static int rename_noreplace(int dirfd, const char *from, const char *to) {
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+    if (renameat2(dirfd, from, dirfd, to, RENAME_NOREPLACE) == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+#endif
+    // The system (or filesystem) can't do this atomically:
+    struct stat info;
+    if (fstatat(dirfd, to, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return renameat(dirfd, from, dirfd, to);
+}
+
+//
+// Return the new state for renaming the files in a listing of `count` files.
+//
+rename_t *rename_new(int count) {
+    rename_t *r = new (rename_t);
+    r->count = count;
+    r->targets = new (char * [(size_t)MAX(count, 1)]);
+    r->conflicts = new (unsigned char[(size_t)MAX(count, 1)]);
+    return r;
+}
+
+//
+// Free the state for renaming files.
+//
+void rename_free(rename_t *r) {
+    for (int id = 0; id < r->count; id++)
+        delete (&r->targets[id]);
+    delete (&r->targets);
+    delete (&r->conflicts);
+    delete (&r);
+}
+
+//
+// Edit the pattern or replacement with a key press, and return what bb should
+// do about it. Tab switches between the pattern and the replacement.
+//
+rename_action_t rename_key(rename_t *r, int key) {
+    char *field = r->fields[r->field];
+    size_t len = strlen(field);
+    switch (key) {
+    case KEY_ENTER: return RENAME_COMMIT;
+    case KEY_ESC: case KEY_CTRL_C: return RENAME_CANCEL;
+    case KEY_TAB: r->field = !r->field; return RENAME_EDITED;
+    case KEY_CTRL_U: field[0] = '\0'; return RENAME_EDITED;
+    case KEY_BACKSPACE: case KEY_BACKSPACE2:
+        if (len > 0) field[len - 1] = '\0';
+        return RENAME_EDITED;
+    default:
+        if (key < ' ' || key > '~' || len + 1 >= sizeof(r->fields[0])) return RENAME_IGNORED;
+        field[len] = (char)key;
+        field[len + 1] = '\0';
+        return RENAME_EDITED;
+    }
+}
+
+//
+// Apply the pattern to the names of the selected files in bb's listing, and
+// find which of the new paths conflict: those that are the same as another
+// new path, or the path of a file that's already listed or that exists.
+//
+void rename_update(rename_t *r, bb_t *bb) {
+    for (int id = 0; id < r->count; id++)
+        delete (&r->targets[id]);
+    memset(r->conflicts, 0, (size_t)r->count);
+    r->nrenamed = r->nconflicts = 0;
+    r->error[0] = '\0';
+    if (!r->fields[0][0]) return;
+
+    regex_t re;
+    int status = regcomp(&re, r->fields[0], REG_EXTENDED);
+    if (status != 0) {
+        regerror(status, &re, r->error, sizeof(r->error));
+        return;
+    }
+    for (int i = 0; i < bb->nloaded; i++) {
+        entry_t *e = bb->loaded[i];
+        if (!IS_SELECTED(bb, e) || e->id >= r->count) continue;
+        const char *name = strrchr(e->fullname, '/') + 1;
+        char newname[PATH_MAX];
+        if (!name[0] || !substitute(&re, name, r->fields[1], newname, sizeof(newname))) continue;
+        if (streq(newname, name)) continue;
+        nonnegative(asprintf(&r->targets[e->id], "%.*s%s", (int)(name - e->fullname), e->fullname, newname));
+        ++r->nrenamed;
+        if (!newname[0] || strchr(newname, '/') || streq(newname, ".") || streq(newname, ".."))
+            r->conflicts[e->id] = 1;
+    }
+    regfree(&re);
+
+    size_t size = 16;
+    while (size < 2 * (size_t)(bb->nloaded + r->nrenamed))
+        size *= 2;
+    path_slot_t *set = new (path_slot_t[size]);
+    for (int i = 0; i < bb->nloaded; i++)
+        *find_path(set, size, bb->loaded[i]->fullname) = (path_slot_t){bb->loaded[i]->fullname, bb->loaded[i]->id, 0};
+    for (int id = 0; id < r->count; id++) {
+        if (!r->targets[id]) continue;
+        path_slot_t *slot = find_path(set, size, r->targets[id]);
+        struct stat info;
+        if (slot->path) { // Another file has (or will have) this path
+            r->conflicts[id] = 1;
+            if (slot->is_target) r->conflicts[slot->id] = 1;
+        } else if (lstat(r->targets[id], &info) == 0) { // An unlisted file has this path
+            r->conflicts[id] = 1;
+        } else {
+            *slot = (path_slot_t){r->targets[id], id, 1};
+        }
+    }
+    delete (&set);
+    for (int id = 0; id < r->count; id++)
+        r->nconflicts += r->conflicts[id];
+}
+
+//
+// Rename the files to their new names (which must not conflict), one
+// directory at a time, calling `renamed(e, path)` for each entry whose file
+// was renamed, which returns the entry with its new path. Return the number of
+// files that couldn't be renamed, and describe the first failure in `err`.
+//
+int rename_commit(rename_t *r, bb_t *bb, entry_t *(*renamed)(entry_t *e, const char *path), char *err,
+                  size_t errsize) {
+    renamed_file_t *files = new (renamed_file_t[(size_t)MAX(r->nrenamed, 1)]);
+    int n = 0;
+    for (int i = 0; i < bb->nloaded; i++)
+        if (bb->loaded[i]->id < r->count && r->targets[bb->loaded[i]->id])
+            files[n++] = (renamed_file_t){bb->loaded[i], i};
+    qsort(files, (size_t)n, sizeof(renamed_file_t), compare_renamed_files);
+
+    int failures = 0, dirfd = -1;
+    char dir[PATH_MAX] = "";
+    for (int i = 0; i < n; i++) {
+        entry_t *e = files[i].entry;
+        const char *name = strrchr(e->fullname, '/') + 1;
+        size_t dirlen = (size_t)(name - e->fullname);
+        if (i == 0 || strlen(dir) != dirlen || strncmp(dir, e->fullname, dirlen) != 0) {
+            if (dirfd >= 0) close(dirfd);
+            snprintf(dir, sizeof(dir), "%.*s", (int)dirlen, e->fullname);
+            dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        const char *target = r->targets[e->id];
+        if (dirfd < 0 || rename_noreplace(dirfd, name, target + dirlen) != 0) {
+            if (failures++ == 0) snprintf(err, errsize, "%s: %s", name, strerror(errno));
+            continue;
+        }
+        int index = e->index;
+        bb->loaded[files[i].index] = e = renamed(e, target);
+        if (index >= 0) bb->files[index] = e;
+    }
+    if (dirfd >= 0) close(dirfd);
+    delete (&files);
+    return failures;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
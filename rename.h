@@ -0,0 +1,49 @@
+//
+// rename.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for renaming the selected files with a
+// pattern, previewing the new names in the listing while the pattern is typed.
+//
+
+#ifndef FILE_RENAME__H
+#define FILE_RENAME__H
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "types.h"
+
+// What to do after a key is pressed while renaming:
+typedef enum {
+    RENAME_EDITED,
+    RENAME_IGNORED,
+    RENAME_COMMIT,
+    RENAME_CANCEL,
+} rename_action_t;
+
+//
+// The state of renaming the selected files in a listing. The pattern is a
+// regular expression, and the first match in each file's name is replaced by
+// the replacement. The new paths are indexed by the files' IDs (see entry_t).
+//
+typedef struct rename_s {
+    char fields[2][PATH_MAX]; // The pattern and the replacement
+    int field;                // Which of the fields is being edited
+    char error[128];          // Why the pattern is invalid (if it is)
+    char **targets;           // New full paths (NULL for files not being renamed)
+    unsigned char *conflicts; // Whether each new path conflicts with another file
+    int count, nrenamed, nconflicts;
+    unsigned int was_viewing_selection : 1;
+} rename_t;
+
+rename_t *rename_new(int count);
+void rename_free(rename_t *r);
+rename_action_t rename_key(rename_t *r, int key);
+void rename_update(rename_t *r, bb_t *bb);
+int rename_commit(rename_t *r, bb_t *bb, entry_t *(*renamed)(entry_t *e, const char *path), char *err,
+                  size_t errsize);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
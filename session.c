@@ -0,0 +1,187 @@
+//
+// session.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of session snapshots. A snapshot is
+// written to a temporary file which then replaces the old snapshot, so a
+// snapshot is never partially written. Snapshots are read by mapping them into
+// memory and checking that all the sizes and offsets in them are valid.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "utils.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+//
+// Calculate where each part of a snapshot with the given header goes, and
+// return the size of the whole snapshot.
+//
+static size_t session_layout(const session_header_t *h, size_t *files, size_t *order, size_t *selection,
+                             size_t *strings) {
+    *files = ALIGN8(sizeof(session_header_t));
+    *order = *files + (size_t)h->nfiles * sizeof(session_file_t);
+    *selection = ALIGN8(*order + (size_t)h->nfiles * sizeof(uint32_t));
+    *strings = *selection + (((size_t)h->nfiles + 63) / 64) * sizeof(uint64_t);
+    return *strings + h->strings_size;
+}
+
+//
+// Add a string to a snapshot's strings and return its offset.
+//
+static uint32_t add_string(FILE *strings, const char *str) {
+    uint32_t offset = (uint32_t)ftello(strings);
+    fwrite(str, 1, strlen(str) + 1, strings);
+    return offset;
+}
+
+//
+// Return whether a snapshot's strings from `offset` hold `count` strings.
+//
+static int has_strings(const session_t *s, uint32_t offset, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (offset >= s->header->strings_size) return 0;
+        offset += (uint32_t)strlen(s->strings + offset) + 1;
+    }
+    return 1;
+}
+
+//
+// Write a snapshot of bb's state to the file at `path`: the current listing
+// (if `with_listing` is set), the selected files that aren't in it, and the
+// history. Return 0 on success or -1 on failure.
+//
+int session_write(const char *path, bb_t *bb, int with_listing, char **selected, int nselected) {
+    session_header_t header = {0};
+    memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+    header.header_size = sizeof(session_header_t);
+    header.stat_size = sizeof(struct stat);
+    struct stat dirinfo;
+    if (stat(bb->path, &dirinfo) != 0) return -1;
+    header.dir_mtime = get_mtime(dirinfo);
+    header.dir_dev = dirinfo.st_dev;
+    header.dir_ino = dirinfo.st_ino;
+    header.nfiles = with_listing ? (uint32_t)bb->nloaded : 0;
+    header.cursor = bb->cursor;
+    header.scroll = bb->scroll;
+    header.interleave_dirs = bb->interleave_dirs;
+
+    char *strings = NULL;
+    size_t strings_size = 0;
+    FILE *s = nonnull(open_memstream(&strings, &strings_size));
+    header.path = add_string(s, bb->path);
+    header.globpats = add_string(s, bb->globpats);
+    header.sort = add_string(s, bb->sort);
+    header.columns = add_string(s, bb->columns);
+    session_file_t *files = new (session_file_t[MAX(header.nfiles, 1)]);
+    uint32_t *order = new (uint32_t[MAX(header.nfiles, 1)]);
+    for (uint32_t i = 0; i < header.nfiles; i++) {
+        entry_t *e = bb->loaded[i];
+        order[i] = (uint32_t)e->id;
+        files[e->id].info = e->info;
+        files[e->id].name = add_string(s, e->name);
+        files[e->id].linkname = e->linkname ? add_string(s, e->linkname) : SESSION_NONE;
+    }
+    header.selected = (uint32_t)ftello(s);
+    header.nselected = (uint32_t)nselected;
+    for (int i = 0; i < nselected; i++)
+        add_string(s, selected[i]);
+    bb_history_t *first = bb->history;
+    while (first && first->prev)
+        first = first->prev;
+    header.history = (uint32_t)ftello(s);
+    for (bb_history_t *h = first; h; h = h->next) {
+        if (h == bb->history) header.history_current = header.nhistory;
+        add_string(s, h->path);
+        ++header.nhistory;
+    }
+    fclose(s);
+    header.strings_size = (uint32_t)strings_size;
+
+    size_t files_at, order_at, selection_at, strings_at;
+    size_t size = session_layout(&header, &files_at, &order_at, &selection_at, &strings_at);
+    char *buf = new_bytes(size);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + files_at, files, header.nfiles * sizeof(session_file_t));
+    memcpy(buf + order_at, order, header.nfiles * sizeof(uint32_t));
+    if (header.nfiles > 0) memcpy(buf + selection_at, bb->selection.words, strings_at - selection_at);
+    memcpy(buf + strings_at, strings, strings_size);
+    delete (&files);
+    delete (&order);
+    delete (&strings);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    int ok = fd >= 0 && write(fd, buf, size) == (ssize_t)size;
+    if (fd >= 0) ok = (close(fd) == 0) && ok;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok && fd >= 0) unlink(tmp);
+    delete (&buf);
+    return ok ? 0 : -1;
+}
+
+//
+// Map the snapshot at `path` into memory and return it, or NULL if it can't
+// be read or isn't a valid snapshot.
+//
+session_t *session_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat info;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(session_header_t))
+        map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    session_t *s = new (session_t);
+    s->map = map;
+    s->size = (size_t)info.st_size;
+    s->header = map;
+    const session_header_t *h = s->header;
+    size_t files_at, order_at, selection_at, strings_at;
+    if (memcmp(h->magic, SESSION_MAGIC, sizeof(h->magic)) != 0 || h->header_size != sizeof(session_header_t)
+        || h->stat_size != sizeof(struct stat)
+        || session_layout(h, &files_at, &order_at, &selection_at, &strings_at) != s->size
+        || h->strings_size == 0)
+        goto invalid;
+    s->files = (const session_file_t *)((const char *)map + files_at);
+    s->order = (const uint32_t *)((const char *)map + order_at);
+    s->selection = (const uint64_t *)((const char *)map + selection_at);
+    s->strings = (const char *)map + strings_at;
+    if (s->strings[h->strings_size - 1] != '\0') goto invalid;
+    if (!has_strings(s, h->path, 1) || !has_strings(s, h->globpats, 1) || !has_strings(s, h->sort, 1)
+        || !has_strings(s, h->columns, 1) || strlen(s->strings + h->sort) > MAX_SORT
+        || strlen(s->strings + h->columns) > MAX_COLS || !has_strings(s, h->selected, h->nselected)
+        || !has_strings(s, h->history, h->nhistory) || (h->nhistory > 0 && h->history_current >= h->nhistory))
+        goto invalid;
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        if (s->order[i] >= h->nfiles || !has_strings(s, s->files[i].name, 1)) goto invalid;
+        if (s->files[i].linkname != SESSION_NONE && !has_strings(s, s->files[i].linkname, 1)) goto invalid;
+    }
+    return s;
+
+invalid:
+    session_close(s);
+    return NULL;
+}
+
+//
+// Unmap a snapshot from memory.
+//
+void session_close(session_t *s) {
+    munmap(s->map, s->size);
+    delete (&s);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
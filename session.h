@@ -0,0 +1,67 @@
+//
+// session.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for session snapshots, which let bb start up
+// showing the same listing, selection and history it had when it last exited.
+//
+
+#ifndef FILE_SESSION__H
+#define FILE_SESSION__H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "types.h"
+
+#define SESSION_MAGIC "bbsess1"
+#define SESSION_NONE UINT32_MAX
+
+// A listed file in a snapshot (strings are offsets in the snapshot's strings):
+typedef struct {
+    struct stat info;
+    uint32_t name, linkname; // linkname is SESSION_NONE if the file isn't a link
+} session_file_t;
+
+//
+// The start of a snapshot file, which is followed by the listed files in the
+// order they were loaded (session_file_t[nfiles]), their IDs in sorted order
+// (uint32_t[nfiles]), which of them are selected (uint64_t words of bits), and
+// then the strings. Everything is fixed-size or an offset, so the file can be
+// used in place after it's mapped into memory.
+//
+typedef struct {
+    char magic[8];
+    uint32_t header_size, stat_size; // Snapshots from other builds are ignored
+    uint32_t nfiles, strings_size;
+    int32_t cursor, scroll;
+    // The directory, which must not have changed since the snapshot was made
+    // for its listing to be used:
+    struct timespec dir_mtime;
+    dev_t dir_dev;
+    ino_t dir_ino;
+    uint32_t path, globpats, sort, columns;
+    // NUL-separated paths of selected files that aren't in the listing, and
+    // of the directories in the history (oldest first):
+    uint32_t selected, nselected, history, nhistory, history_current;
+    uint32_t interleave_dirs;
+} session_header_t;
+
+// A snapshot that has been mapped into memory:
+typedef struct {
+    void *map;
+    size_t size;
+    const session_header_t *header;
+    const session_file_t *files;
+    const uint32_t *order;
+    const uint64_t *selection;
+    const char *strings;
+} session_t;
+
+int session_write(const char *path, bb_t *bb, int with_listing, char **selected, int nselected);
+session_t *session_open(const char *path);
+void session_close(session_t *s);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
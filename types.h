@@ -11,12 +11,16 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bitset.h"
+
 #define MAX_COLS 12
 #define MAX_SORT (2 * MAX_COLS)
 #define HASH_SIZE 1024
 #define HASH_MASK (HASH_SIZE - 1)
+#define MAX_WARNINGS 8
 
 //
 // Datastructure for file/directory entries.
@@ -35,8 +39,12 @@ typedef struct entry_s {
     mode_t linkedmode;
     int no_esc : 1;
     int link_no_esc : 1;
+    unsigned int link_resolved : 1;
+    unsigned int listed : 1;
+    unsigned char color; // Index of the entry's color (0 if not looked up yet)
     int shufflepos;
     int index;
+    int id; // Position in the current listing, which doesn't change when it's sorted or filtered
     char fullname[1];
     // ------- fullname must be last! --------------
     // When entries are allocated, extra space on the end is reserved to fill
@@ -51,6 +59,15 @@ typedef struct proc_s {
     } running;
 } proc_t;
 
+// Warnings shown in the status line. Warnings with the same format string are
+// shown as one warning (the most recent message), with a count.
+typedef struct {
+    const char *fmt;
+    char message[256];
+    int count;
+    time_t time;
+} warning_t;
+
 // History of paths
 typedef struct bb_history_s {
     char path[PATH_MAX];
@@ -60,19 +77,35 @@ typedef struct bb_history_s {
 // Structure for bb program state:
 typedef struct bb_s {
     entry_t *hash[HASH_SIZE];
-    entry_t **files;
+    // All the files loaded for the current directory (in sorted order), and
+    // the ones among them that match the globs and are being displayed:
+    entry_t **loaded, **files;
+    // The listing of the current directory if it's too big for the above:
+    struct bigdir_s *bigdir;
+    // The state of renaming the selected files (if they're being renamed):
+    struct rename_s *renaming;
+    // The selected files in the current listing (by ID), the other selected
+    // files (most recently selected first), and the selected files from big
+    // directories that were left before their entries were loaded (sorted):
+    bitset_t selection;
     entry_t *selected;
+    char **selected_paths;
     char path[PATH_MAX];
     bb_history_t *history;
-    int nfiles, nselected;
+    warning_t warnings[MAX_WARNINGS]; // Most recent first
+    int nloaded, nfiles, nselected, nselected_paths;
     int scroll, cursor;
 
     char *globpats;
     char sort[MAX_SORT + 1];
     char columns[MAX_COLS + 1];
     unsigned int interleave_dirs : 1;
+    unsigned int loaded_all : 1;
+    unsigned int viewing_selection : 1;
     unsigned int should_quit : 1;
     unsigned int dirty : 1;
+    // The listing changed, but not the rest of the screen:
+    unsigned int listing_changed : 1;
     proc_t *running_procs;
 } bb_t;
 
@@ -7,9 +7,105 @@
 // easily error checking.
 //
 
+#include <ctype.h>
 #include <err.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#ifdef BB_ALLOC_STATS
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define allocated_size(p) malloc_size(p)
+#else
+#include <malloc.h>
+#define allocated_size(p) malloc_usable_size(p)
+#endif
+#include <stdint.h>
+
+#define MAX_ALLOC_SITES 4096
+
+// Allocations counted in each phase, and the most memory in use during it:
+static struct {
+    unsigned long count;
+    size_t bytes, peak;
+} phases[NUM_ALLOC_PHASES];
+static const char *phase_names[NUM_ALLOC_PHASES] = {
+    [ALLOC_OTHER] = "other",   [ALLOC_POPULATE] = "populate", [ALLOC_SORT] = "sort",
+    [ALLOC_RENDER] = "render", [ALLOC_COMMAND] = "command",
+};
+// Allocations counted at each call site (a hash table by the site's string):
+typedef struct {
+    const char *site;
+    unsigned long count;
+    size_t bytes;
+} alloc_site_t;
+static alloc_site_t sites[MAX_ALLOC_SITES];
+// The counted allocations that haven't been freed yet and their sizes (a hash
+// table by address), so that freeing memory that libc allocated (e.g. with
+// getline() or open_memstream()) doesn't take anything off of `in_use`:
+typedef struct {
+    void *p;
+    size_t size;
+} live_alloc_t;
+static live_alloc_t *live = NULL;
+static size_t live_count = 0, live_size = 0;
+static alloc_phase_t current_phase = ALLOC_OTHER;
+static size_t in_use = 0;
+
+static size_t live_slot(void *p) {
+    return (size_t)(((uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> 32) & (live_size - 1);
+}
+
+//
+// Remember the size of a counted allocation.
+//
+static void track_allocation(void *p, size_t size) {
+    if (2 * (live_count + 1) > live_size) {
+        live_alloc_t *old = live;
+        size_t old_size = live_size;
+        live_size = MAX(1024, 2 * live_size);
+        live = calloc(live_size, sizeof(live_alloc_t));
+        if (!live) err(EXIT_FAILURE, "Could not allocate memory for allocation stats");
+        live_count = 0;
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].p) track_allocation(old[i].p, old[i].size);
+        free(old);
+    }
+    size_t i = live_slot(p);
+    while (live[i].p)
+        i = (i + 1) & (live_size - 1);
+    live[i] = (live_alloc_t){p, size};
+    ++live_count;
+}
+
+//
+// Forget a counted allocation and return its size (or 0 if it wasn't counted).
+//
+static size_t untrack_allocation(void *p) {
+    if (live_count == 0) return 0;
+    size_t i = live_slot(p);
+    while (live[i].p && live[i].p != p)
+        i = (i + 1) & (live_size - 1);
+    if (!live[i].p) return 0;
+    size_t size = live[i].size;
+    --live_count;
+    // Move later entries back into the gap if it's between them and their slots:
+    for (size_t j = i;;) {
+        live[i].p = NULL;
+        size_t home;
+        do {
+            j = (j + 1) & (live_size - 1);
+            if (!live[j].p) return size;
+            home = live_slot(live[j].p);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        live[i] = live[j];
+        i = j;
+    }
+}
+#endif
 
 //
 // If the given argument is nonnegative, print the error message and exit with
@@ -46,9 +142,164 @@ void *check_nonnull(void *p, const char *err_msg, ...) {
 //
 void delete(void *p) {
     if (*(void **)p != NULL) {
+#ifdef BB_ALLOC_STATS
+        in_use -= untrack_allocation(*(void **)p);
+#endif
         free(*(void **)p);
         *(void **)p = NULL;
     }
 }
 
+//
+// Compare two filenames for sorting, returning a negative number if `n1` goes
+// first, a positive number if `n2` goes first, or 0 if they're the same.
+// This sorting method is not identical to strverscmp(). Notably, bb's sort
+// will order: [0, 1, 9, 00, 01, 09, 10, 000, 010] instead of strverscmp()'s
+// order: [000, 00, 01, 010, 09, 0, 1, 9, 10]. I believe bb's sort is consistent
+// with how people want their files grouped: all files padded to n digits
+// will be grouped together, and files with the same padding will be sorted
+// ordinally. This version also does case-insensitivity by lowercasing words,
+// so the following characters come before all letters: [\]^_`
+//
+int compare_names(const char *n1, const char *n2) {
+    const char *start1 = n1, *start2 = n2;
+    while (*n1 && *n2) {
+        char c1 = tolower(*n1), c2 = tolower(*n2);
+        if ('0' <= c1 && c1 <= '9' && '0' <= c2 && c2 <= '9') {
+            long i1 = strtol(n1, (char **)&n1, 10);
+            long i2 = strtol(n2, (char **)&n2, 10);
+            // Shorter numbers always go before longer. In practice, I assume
+            // filenames padded to the same number of digits should be grouped
+            // together, instead of
+            // [1.png, 0001.png, 2.png, 0002.png, 3.png], it makes more sense to have:
+            // [1.png, 2.png, 3.png, 0001.png, 0002.png]
+            if (n1 - start1 != n2 - start2) return (n1 - start1) < (n2 - start2) ? -1 : 1;
+            if (i1 != i2) return i1 < i2 ? -1 : 1;
+        } else {
+            if (c1 != c2) return c1 < c2 ? -1 : 1;
+            ++n1;
+            ++n2;
+        }
+    }
+    int c1 = tolower(*n1), c2 = tolower(*n2);
+    return c1 == c2 ? 0 : (c1 < c2 ? -1 : 1);
+}
+
+//
+// Compare two paths so that the files in each directory are grouped together:
+// by directory first, then by name. Bytes are compared as-is (not like
+// compare_names()), so the order never depends on the locale or on bb's
+// settings, and paths saved in this order can be merged with each other.
+//
+int compare_paths(const char *p1, const char *p2) {
+    const char *slash1 = strrchr(p1, '/'), *slash2 = strrchr(p2, '/');
+    size_t dirlen1 = slash1 ? (size_t)(slash1 - p1) : 0, dirlen2 = slash2 ? (size_t)(slash2 - p2) : 0;
+    int cmp = memcmp(p1, p2, dirlen1 < dirlen2 ? dirlen1 : dirlen2);
+    if (cmp != 0) return cmp;
+    if (dirlen1 != dirlen2) return dirlen1 < dirlen2 ? -1 : 1;
+    return strcmp(p1 + dirlen1, p2 + dirlen2);
+}
+
+//
+// Hash some bytes (FNV-1a).
+//
+uint64_t hash_bytes(const void *bytes, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ ((const unsigned char *)bytes)[i]) * 1099511628211ULL;
+    return hash;
+}
+
+#ifdef BB_ALLOC_STATS
+//
+// Count an allocation of `p` (which replaced `old_size` bytes, if it was
+// reallocated) made at the given call site.
+//
+static void count_allocation(void *p, size_t old_size, const char *site) {
+    size_t size = allocated_size(p);
+    track_allocation(p, size);
+    in_use = in_use - old_size + size;
+    ++phases[current_phase].count;
+    phases[current_phase].bytes += size;
+    if (in_use > phases[current_phase].peak) phases[current_phase].peak = in_use;
+
+    size_t i = ((uintptr_t)site >> 3) & (MAX_ALLOC_SITES - 1);
+    for (size_t probes = 0; sites[i].site && sites[i].site != site; probes++) {
+        if (probes == MAX_ALLOC_SITES) return;
+        i = (i + 1) & (MAX_ALLOC_SITES - 1);
+    }
+    sites[i].site = site;
+    ++sites[i].count;
+    sites[i].bytes += size;
+}
+
+//
+// calloc(), with the allocation counted.
+//
+void *alloc_calloc(size_t count, size_t size, const char *site) {
+    void *p = calloc(count, size);
+    if (p) count_allocation(p, 0, site);
+    return p;
+}
+
+//
+// reallocarray(), with the allocation counted.
+//
+void *alloc_reallocarray(void *p, size_t count, size_t size, const char *site) {
+    size_t old_size = p ? untrack_allocation(p) : 0;
+    void *grown = reallocarray(p, count, size);
+    if (grown) count_allocation(grown, old_size, site);
+    else if (p) track_allocation(p, old_size);
+    return grown;
+}
+
+//
+// strdup(), with the allocation counted.
+//
+char *alloc_strdup(const char *s, const char *site) {
+    char *copy = strdup(s);
+    if (copy) count_allocation(copy, 0, site);
+    return copy;
+}
+
+//
+// Start counting allocations as part of a phase, and return the previous one.
+//
+alloc_phase_t alloc_enter_phase(alloc_phase_t phase) {
+    alloc_phase_t prev = current_phase;
+    current_phase = phase;
+    return prev;
+}
+
+//
+// Go back to counting allocations as part of the previous phase (this is the
+// cleanup for ALLOC_PHASE()).
+//
+void alloc_leave_phase(alloc_phase_t *prev) { current_phase = *prev; }
+
+static int compare_site_bytes(const void *v1, const void *v2) {
+    size_t b1 = ((const alloc_site_t *)v1)->bytes, b2 = ((const alloc_site_t *)v2)->bytes;
+    return b1 == b2 ? 0 : (b1 > b2 ? -1 : 1);
+}
+
+//
+// Print how many allocations were made (and how many bytes) in each phase and
+// at the call sites that allocated the most, and the most memory that was in
+// use during each phase.
+//
+void alloc_print_report(FILE *out) {
+    fprintf(out, "%-10s %12s %14s %14s\n", "Phase", "Allocations", "Bytes", "Peak in use");
+    for (int p = 0; p < NUM_ALLOC_PHASES; p++)
+        fprintf(out, "%-10s %12lu %14zu %14zu\n", phase_names[p], phases[p].count, phases[p].bytes, phases[p].peak);
+    fprintf(out, "%-10s %12s %14s %14zu\n\n", "now", "", "", in_use);
+
+    static alloc_site_t sorted[MAX_ALLOC_SITES];
+    memcpy(sorted, sites, sizeof(sorted));
+    qsort(sorted, MAX_ALLOC_SITES, sizeof(alloc_site_t), compare_site_bytes);
+    fprintf(out, "%-40s %12s %14s\n", "Call site", "Allocations", "Bytes");
+    for (int i = 0; i < MAX_ALLOC_SITES; i++)
+        if (sorted[i].site) fprintf(out, "%-40s %12lu %14zu\n", sorted[i].site, sorted[i].count, sorted[i].bytes);
+}
+#endif
+
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
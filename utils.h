@@ -9,6 +9,8 @@
 #ifndef FILE_UTILS__H
 #define FILE_UTILS__H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #ifndef streq
@@ -30,12 +32,11 @@
 #endif
 
 // Entry macros
-#define IS_SELECTED(e) (((e)->selected.atme) != NULL)
+#define IS_SELECTED(bb, e) (IS_LISTED(e) ? BITSET_GET(&(bb)->selection, (e)->id) : ((e)->selected.atme) != NULL)
 #define IS_VIEWED(e) ((e)->index >= 0)
+#define IS_LISTED(e) ((e)->listed)
 #define IS_LOADED(e) ((e)->hash.atme != NULL)
 
-#define E_ISDIR(e) (S_ISDIR(S_ISLNK((e)->info.st_mode) ? (e)->linkedmode : (e)->info.st_mode))
-
 // Linked list macros
 #define LL_PREPEND(head, node, name)                                                                                   \
     do {                                                                                                               \
@@ -64,16 +65,51 @@
 #define nonnegative(exp, ...) check_nonnegative(exp, __LOCATION__ ": `" #exp "` " __VA_ARGS__)
 #define nonnull(exp, ...) check_nonnull(exp, __LOCATION__ ": `" #exp "` " __VA_ARGS__)
 // Error-checking memory allocation helper macros:
+#ifdef BB_ALLOC_STATS
+// Count allocations by call site and by what bb was doing (see alloc_print_report())
+#define new(t) check_nonnull(alloc_calloc(1, sizeof(t), __LOCATION__), __LOCATION__ ": new(" #t ") failed")
+#define new_bytes(n) check_nonnull(alloc_calloc(1, n, __LOCATION__), __LOCATION__ ": new_bytes(" #n ") failed")
+#define grow(obj, new_count)                                                                                           \
+    check_nonnull(alloc_reallocarray(obj, (new_count), sizeof(obj[0]), __LOCATION__),                                 \
+                  __LOCATION__ ": grow(" #obj ", " #new_count ") failed")
+#define check_strdup(s) check_nonnull(alloc_strdup(s, __LOCATION__), __LOCATION__ ": check_strdup(" #s ") failed")
+// Count the allocations until the end of the current scope as part of a phase:
+#define ALLOC_PHASE(phase)                                                                                             \
+    __attribute__((cleanup(alloc_leave_phase))) alloc_phase_t alloc_prev_phase_ = alloc_enter_phase(phase)
+#else
 #define new(t) check_nonnull(calloc(1, sizeof(t)), __LOCATION__ ": new(" #t ") failed")
 #define new_bytes(n) check_nonnull(calloc(1, n), __LOCATION__ ": new_bytes(" #n ") failed")
 #define grow(obj, new_count)                                                                                           \
     check_nonnull(reallocarray(obj, (new_count), sizeof(obj[0])),                                                      \
                   __LOCATION__ ": grow(" #obj ", " #new_count ") failed")
 #define check_strdup(s) check_nonnull(strdup(s), __LOCATION__ ": check_strdup(" #s ") failed")
+#define ALLOC_PHASE(phase) (void)(phase)
+#endif
+
+// What bb is doing, for counting allocations (when built with BB_ALLOC_STATS):
+typedef enum {
+    ALLOC_OTHER,
+    ALLOC_POPULATE,
+    ALLOC_SORT,
+    ALLOC_RENDER,
+    ALLOC_COMMAND,
+    NUM_ALLOC_PHASES,
+} alloc_phase_t;
 
 int check_nonnegative(int negative_err, const char *err_msg, ...);
 __attribute__((returns_nonnull)) void *check_nonnull(void *p, const char *err_msg, ...);
 __attribute__((nonnull)) void delete(void *p);
+int compare_names(const char *n1, const char *n2);
+int compare_paths(const char *p1, const char *p2);
+uint64_t hash_bytes(const void *bytes, size_t len);
+#ifdef BB_ALLOC_STATS
+void *alloc_calloc(size_t count, size_t size, const char *site);
+void *alloc_reallocarray(void *p, size_t count, size_t size, const char *site);
+char *alloc_strdup(const char *s, const char *site);
+alloc_phase_t alloc_enter_phase(alloc_phase_t phase);
+void alloc_leave_phase(alloc_phase_t *prev);
+void alloc_print_report(FILE *out);
+#endif
 
 #endif
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,383 @@
+//
+// xattrs.c
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains the implementation of bb's extended attribute lookups.
+// Listing a file's attributes can be slow (e.g. on network filesystems), so
+// it's done by a few worker processes, which are sent paths over a socket and
+// reply with one byte of flags per path, in order. Requests for files that
+// are being drawn go to the front of the queue, and the results are cached by
+// inode and ctime (which changes whenever a file's attributes do), so they
+// survive reloading the listing.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/xattr.h>
+#endif
+
+#include "mem.h"
+#include "utils.h"
+#include "xattrs.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define XATTR_HASH_SIZE 4096
+#define XATTR_HASH_MASK (XATTR_HASH_SIZE - 1)
+// How many worker processes there are, and how many requests each one has at a time:
+#define XATTR_WORKERS 2
+#define XATTR_IN_FLIGHT 16
+// A lookup that has been requested but not done yet:
+#define XATTR_PENDING (-2)
+
+typedef struct xattr_info_s {
+    struct xattr_info_s *next;
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;
+    unsigned int generation;
+    int flags;
+} xattr_info_t;
+
+// A lookup that hasn't been sent to a worker yet:
+typedef struct {
+    xattr_info_t *info;
+    char *path;
+} request_t;
+
+typedef struct {
+    pid_t pid;
+    int fd;
+    char *out; // Requests that haven't been written to the socket yet
+    size_t outlen, outsize;
+    xattr_info_t *inflight[XATTR_IN_FLIGHT]; // Requests waiting for replies, oldest first
+    int first, count;
+} worker_t;
+
+static size_t reclaim_xattrs(size_t want);
+
+static xattr_info_t *infos[XATTR_HASH_SIZE] = {0};
+static unsigned int generation = 0;
+static mempool_t xattr_pool = {.name = "Extended attributes", .reclaim = reclaim_xattrs};
+// The requests waiting for a worker (a ring buffer, most urgent first):
+static request_t *queue = NULL;
+static int queue_start = 0, queue_len = 0, queue_size = 0;
+static worker_t workers[XATTR_WORKERS] = {0};
+
+static unsigned int hash_inode(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)dev;
+    return (unsigned int)(h >> 32) & XATTR_HASH_MASK;
+}
+
+//
+// Free cached lookups (ones that haven't been used since the current
+// directory was loaded go first) until `want` bytes have been freed. Lookups
+// that are still pending are kept, since the workers will reply to them.
+//
+static size_t reclaim_xattrs(size_t want) {
+    size_t freed = 0;
+    for (int cold_only = 1; cold_only >= 0 && freed < want; cold_only--) {
+        for (int i = 0; i < XATTR_HASH_SIZE && freed < want; i++) {
+            for (xattr_info_t **x = &infos[i]; *x && freed < want;) {
+                if ((*x)->flags == XATTR_PENDING || (cold_only && (*x)->generation == generation)) {
+                    x = &(*x)->next;
+                    continue;
+                }
+                xattr_info_t *dead = *x;
+                *x = dead->next;
+                freed += sizeof(xattr_info_t);
+                delete (&dead);
+            }
+        }
+    }
+    mem_release(&xattr_pool, freed);
+    return freed;
+}
+
+//
+// Return the flags for the extended attributes of the file at a path.
+//
+static int list_xattrs(const char *path) {
+    static char names[65536];
+#if defined(__linux__)
+    ssize_t len = llistxattr(path, names, sizeof(names));
+#elif defined(__APPLE__)
+    ssize_t len = listxattr(path, names, sizeof(names), XATTR_NOFOLLOW);
+#else
+    ssize_t len = -1;
+    errno = ENOTSUP;
+#endif
+    if (len < 0) return errno == ENOTSUP ? 0 : (errno == ERANGE ? XATTR_OTHER : XATTR_ERROR);
+    int flags = 0;
+    for (const char *name = names; name < names + len; name += strlen(name) + 1) {
+        if (strncmp(name, "system.posix_acl_", strlen("system.posix_acl_")) == 0 || streq(name, "system.nfs4_acl")
+            || streq(name, "system.richacl"))
+            flags |= XATTR_ACL;
+        else if (strncmp(name, "security.", strlen("security.")) == 0) flags |= XATTR_LABEL;
+        else flags |= XATTR_OTHER;
+    }
+    return flags;
+}
+
+//
+// The main loop of a worker process: read NUL-terminated paths and reply
+// with one byte of flags for each, until bb closes the socket.
+//
+static void run_worker(int fd) {
+    int signals[] = {SIGTERM, SIGINT, SIGXCPU, SIGXFSZ, SIGVTALRM, SIGPROF, SIGSEGV, SIGTSTP, SIGWINCH};
+    for (size_t i = 0; i < LEN(signals); i++)
+        signal(signals[i], SIG_DFL);
+    FILE *in = fdopen(fd, "r");
+    if (!in) _exit(EXIT_FAILURE);
+    char *path = NULL;
+    size_t size = 0;
+    while (getdelim(&path, &size, '\0', in) > 0) {
+        unsigned char flags = (unsigned char)list_xattrs(path);
+        while (write(fd, &flags, 1) != 1) {
+            if (errno != EINTR) _exit(EXIT_FAILURE);
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+//
+// Start a worker process, and return 0 if it started.
+//
+static int start_worker(worker_t *w) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return -1;
+    if ((w->pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (w->pid == 0) {
+        close(fds[0]);
+        for (int i = 0; i < XATTR_WORKERS; i++)
+            if (workers[i].pid > 0) close(workers[i].fd);
+        run_worker(fds[1]);
+    }
+    close(fds[1]);
+    w->fd = fds[0];
+    (void)fcntl(w->fd, F_SETFD, FD_CLOEXEC); // Scripts don't need it
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    (void)setsockopt(w->fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return 0;
+}
+
+//
+// Stop a worker process. Any lookups it hadn't finished are marked as failed.
+//
+static void stop_worker(worker_t *w) {
+    close(w->fd);
+    kill(w->pid, SIGTERM);
+    waitpid(w->pid, NULL, 0);
+    w->pid = 0;
+    for (; w->count > 0; w->count--, w->first = (w->first + 1) % XATTR_IN_FLIGHT)
+        w->inflight[w->first]->flags = XATTR_ERROR;
+    w->first = 0;
+    w->outlen = 0;
+}
+
+//
+// Return the cached lookup for a file (or NULL if there isn't one), and mark
+// it as used.
+//
+static xattr_info_t *find_info(entry_t *e) {
+    xattr_info_t *info;
+    for (info = infos[hash_inode(e->info.st_dev, e->info.st_ino)]; info; info = info->next)
+        if (info->dev == e->info.st_dev && info->ino == e->info.st_ino) break;
+    if (info) info->generation = generation;
+    return info;
+}
+
+//
+// Return whether a cached lookup is finished and up to date with the file.
+//
+static int is_current(xattr_info_t *info, entry_t *e) {
+    struct timespec ctime = get_ctime(e->info);
+    return info->flags != XATTR_PENDING && info->ctime.tv_sec == ctime.tv_sec && info->ctime.tv_nsec == ctime.tv_nsec;
+}
+
+//
+// Move a lookup that's waiting for a worker to the front of the queue.
+//
+static void hurry_request(xattr_info_t *info) {
+    for (int i = 0; i < queue_len; i++) {
+        if (queue[(queue_start + i) % queue_size].info != info) continue;
+        request_t r = queue[(queue_start + i) % queue_size];
+        for (; i > 0; i--)
+            queue[(queue_start + i) % queue_size] = queue[(queue_start + i - 1) % queue_size];
+        queue[queue_start] = r;
+        return;
+    }
+}
+
+//
+// Return the flags for a file's extended attributes, or XATTR_UNKNOWN if they
+// haven't been looked up yet, without looking them up.
+//
+int xattrs_cached(entry_t *e) {
+    xattr_info_t *info = find_info(e);
+    return info && is_current(info, e) ? info->flags : XATTR_UNKNOWN;
+}
+
+//
+// Return the flags for a file's extended attributes, or XATTR_UNKNOWN if they
+// haven't been looked up yet, in which case the file will be looked up by a
+// worker (before any files that aren't `urgent`).
+//
+int xattrs_get(entry_t *e, int urgent) {
+    xattr_info_t *info = find_info(e);
+    if (info) {
+        if (info->flags == XATTR_PENDING) {
+            if (urgent) hurry_request(info);
+            return XATTR_UNKNOWN;
+        }
+        if (is_current(info, e)) return info->flags;
+    } else {
+        unsigned int h = hash_inode(e->info.st_dev, e->info.st_ino);
+        info = new (xattr_info_t);
+        info->dev = e->info.st_dev;
+        info->ino = e->info.st_ino;
+        info->generation = generation;
+        info->next = infos[h];
+        infos[h] = info;
+        mem_charge(&xattr_pool, sizeof(xattr_info_t));
+    }
+    info->ctime = get_ctime(e->info);
+    info->flags = XATTR_PENDING;
+
+    if (queue_len == queue_size) {
+        int oldsize = queue_size;
+        queue_size = MAX(64, 2 * queue_size);
+        queue = grow(queue, (size_t)queue_size);
+        // Move the part of the ring that wrapped around to the new end:
+        int wrapped = queue_start + queue_len - oldsize;
+        if (wrapped > 0) {
+            memmove(&queue[queue_size - (oldsize - queue_start)], &queue[queue_start],
+                    sizeof(request_t) * (size_t)(oldsize - queue_start));
+            queue_start = queue_size - (oldsize - queue_start);
+        }
+    }
+    request_t r = {info, check_strdup(e->fullname)};
+    if (urgent) {
+        queue_start = (queue_start + queue_size - 1) % queue_size;
+        queue[queue_start] = r;
+    } else {
+        queue[(queue_start + queue_len) % queue_size] = r;
+    }
+    ++queue_len;
+    return XATTR_UNKNOWN;
+}
+
+//
+// Collect the workers' replies and give them more requests, without waiting
+// for anything. Return how many lookups were finished.
+//
+int xattrs_update(void) {
+    int finished = 0;
+    FOREACH(worker_t *, w, workers) {
+        if (w->pid <= 0 || w->count == 0) continue;
+        unsigned char replies[XATTR_IN_FLIGHT];
+        ssize_t n = recv(w->fd, replies, (size_t)w->count, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            finished += w->count;
+            stop_worker(w);
+            continue;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            w->inflight[w->first]->flags = replies[i];
+            w->first = (w->first + 1) % XATTR_IN_FLIGHT;
+            --w->count;
+            ++finished;
+        }
+    }
+
+    while (queue_len > 0) {
+        worker_t *w = NULL;
+        FOREACH(worker_t *, candidate, workers) {
+            if (candidate->count < XATTR_IN_FLIGHT && (!w || candidate->count < w->count)) w = candidate;
+        }
+        if (!w || (w->pid <= 0 && start_worker(w) != 0)) break;
+        request_t r = queue[queue_start];
+        queue_start = (queue_start + 1) % queue_size;
+        --queue_len;
+        size_t len = strlen(r.path) + 1;
+        if (w->outlen + len > w->outsize) {
+            w->outsize = MAX(2 * w->outsize, w->outlen + len);
+            w->out = grow(w->out, w->outsize);
+        }
+        memcpy(w->out + w->outlen, r.path, len);
+        w->outlen += len;
+        w->inflight[(w->first + w->count++) % XATTR_IN_FLIGHT] = r.info;
+        delete (&r.path);
+    }
+
+    FOREACH(worker_t *, w, workers) {
+        if (w->pid <= 0 || w->outlen == 0) continue;
+        ssize_t sent = send(w->fd, w->out, w->outlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent <= 0) continue; // A worker that died is noticed when its replies are read
+        memmove(w->out, w->out + sent, w->outlen - (size_t)sent);
+        w->outlen -= (size_t)sent;
+    }
+    return finished;
+}
+
+//
+// Return how many lookups haven't been finished yet.
+//
+int xattrs_backlog(void) {
+    int backlog = queue_len;
+    FOREACH(worker_t *, w, workers)
+        backlog += w->count;
+    return backlog;
+}
+
+void xattrs_init(void) { mem_register(&xattr_pool); }
+
+//
+// Mark the start of a new directory listing. Lookups that aren't used again
+// after this are the first to be evicted.
+//
+void xattrs_new_generation(void) { ++generation; }
+
+//
+// Stop the workers and forget everything.
+//
+void xattrs_stop(void) {
+    FOREACH(worker_t *, w, workers) {
+        if (w->pid > 0) stop_worker(w);
+        delete (&w->out);
+        w->outsize = 0;
+    }
+    for (; queue_len > 0; queue_len--, queue_start = (queue_start + 1) % queue_size)
+        delete (&queue[queue_start].path);
+    delete (&queue);
+    queue_size = 0;
+    for (int i = 0; i < XATTR_HASH_SIZE; i++) {
+        for (xattr_info_t *next, *x = infos[i]; x; x = next) {
+            next = x->next;
+            delete (&x);
+        }
+        infos[i] = NULL;
+    }
+    mem_release(&xattr_pool, xattr_pool.used);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0
@@ -0,0 +1,32 @@
+//
+// xattrs.h
+// Copyright 2021 Bruce Hill
+// Released under the MIT license with the Commons Clause
+//
+// This file contains definitions for looking up which files have extended
+// attributes, ACLs, or security labels. The lookups are done by background
+// worker processes and cached, so bb never waits for them.
+//
+
+#ifndef FILE_XATTRS__H
+#define FILE_XATTRS__H
+
+#include "types.h"
+
+// What a file has (or XATTR_UNKNOWN if it hasn't been looked up yet):
+#define XATTR_UNKNOWN (-1)
+#define XATTR_OTHER 1 // Extended attributes besides ACLs and security labels
+#define XATTR_ACL 2
+#define XATTR_LABEL 4
+#define XATTR_ERROR 8 // The attributes couldn't be listed
+
+int xattrs_cached(entry_t *e);
+int xattrs_get(entry_t *e, int urgent);
+int xattrs_update(void);
+int xattrs_backlog(void);
+void xattrs_init(void);
+void xattrs_new_generation(void);
+void xattrs_stop(void);
+
+#endif
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1,\:0